@@ -0,0 +1,40 @@
+#!/bin/bash
+#
+# Runs inside the benchmark VM (see bench/run.sh): loads the module, fills
+# the disk so reads hit real pages, and runs bench/ram_disk.fio once for
+# every combination of the sweep, writing one fio JSON file per run into
+# the results directory.
+
+set -e
+cd "$(dirname "$0")/.."
+
+RESULTS=$1
+SIZE_MB=${SIZE_MB:-1024}
+RUNTIME=${RUNTIME:-10}
+ENGINE=${ENGINE:-io_uring}
+BLOCK_SIZES=${BLOCK_SIZES:-4k 64k 1m}
+QUEUE_DEPTHS=${QUEUE_DEPTHS:-1 32}
+JOB_COUNTS=${JOB_COUNTS:-1 4}
+READ_MIXES=${READ_MIXES:-100 70 0}
+
+insmod build/ram_disk.ko size_mb=$SIZE_MB $MODULE_ARGS
+trap 'rmmod ram_disk' EXIT
+DEV=/dev/ramdisk0
+udevadm settle || true
+
+fio --name=fill --filename=$DEV --rw=write --bs=1m --direct=1 \
+  --ioengine=psync --output=/dev/null
+
+for bs in $BLOCK_SIZES; do
+  for qd in $QUEUE_DEPTHS; do
+    for jobs in $JOB_COUNTS; do
+      for mix in $READ_MIXES; do
+        name=bs${bs}_qd${qd}_jobs${jobs}_read${mix}
+        echo "running $name"
+        DEV=$DEV ENGINE=$ENGINE RUNTIME=$RUNTIME BS=$bs QD=$qd JOBS=$jobs \
+          MIX=$mix fio --output-format=json --output=$RESULTS/$name.json \
+          bench/ram_disk.fio
+      done
+    done
+  done
+done
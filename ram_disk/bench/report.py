@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+"""
+Summarize and compare ram_disk benchmark results.
+
+  report.py summarize RESULTS_DIR   fio JSON files -> one summary (stdout)
+  report.py show SUMMARY            print a summary as a table
+  report.py compare BASELINE NEW    compare two summaries, exit 1 on regression
+
+A summary is a JSON list with one record per run. Bandwidth is in KiB/s and
+latencies (completion latency percentiles) are in microseconds.
+"""
+
+import json
+import os
+import re
+import sys
+
+# Relative change beyond which a metric counts as a regression.
+THRESHOLD = float(os.environ.get("THRESHOLD", "0.10"))
+
+NAME_RE = re.compile(r"bs(\w+)_qd(\d+)_jobs(\d+)_read(\d+)\.json$")
+PERCENTILES = {"p50": "50.000000", "p99": "99.000000", "p99.9": "99.900000"}
+HIGHER_IS_BETTER = ("iops", "bw_kib")
+
+
+def summarize(results_dir):
+    records = []
+    for name in sorted(os.listdir(results_dir)):
+        match = NAME_RE.match(name)
+        if not match:
+            continue
+        with open(os.path.join(results_dir, name)) as f:
+            job = json.load(f)["jobs"][0]
+        record = {
+            "bs": match.group(1),
+            "qd": int(match.group(2)),
+            "jobs": int(match.group(3)),
+            "read_pct": int(match.group(4)),
+        }
+        for direction in ("read", "write"):
+            stats = job[direction]
+            if not stats["io_bytes"]:
+                continue
+            record[direction + "_iops"] = round(stats["iops"], 1)
+            record[direction + "_bw_kib"] = stats["bw"]
+            percentiles = stats["clat_ns"].get("percentile", {})
+            for label, key in PERCENTILES.items():
+                if key in percentiles:
+                    record["%s_%s_us" % (direction, label)] = round(
+                        percentiles[key] / 1000, 2
+                    )
+        records.append(record)
+    return records
+
+
+def key(record):
+    return (record["bs"], record["qd"], record["jobs"], record["read_pct"])
+
+
+def metrics(record):
+    return [k for k in record if k not in ("bs", "qd", "jobs", "read_pct")]
+
+
+def show(records):
+    for record in records:
+        print(
+            "bs=%-4s qd=%-3d jobs=%-2d read=%3d%%  %s"
+            % (
+                key(record)
+                + (" ".join("%s=%s" % (m, record[m]) for m in metrics(record)),)
+            )
+        )
+
+
+def compare(baseline, new):
+    old_by_key = {key(r): r for r in baseline}
+    regressions = 0
+    for record in new:
+        old = old_by_key.get(key(record))
+        if old is None:
+            continue
+        for metric in metrics(record):
+            if metric not in old or not old[metric]:
+                continue
+            change = (record[metric] - old[metric]) / old[metric]
+            if metric.endswith(HIGHER_IS_BETTER):
+                worse = change < -THRESHOLD
+            else:
+                worse = change > THRESHOLD
+            if worse:
+                regressions += 1
+            if worse or abs(change) > THRESHOLD:
+                print(
+                    "%s bs=%s qd=%d jobs=%d read=%d%% %s: %s -> %s (%+.1f%%)"
+                    % (
+                        ("REGRESSION" if worse else "improvement",)
+                        + key(record)
+                        + (metric, old[metric], record[metric], change * 100)
+                    )
+                )
+    print("%d regression(s) beyond %.0f%%" % (regressions, THRESHOLD * 100))
+    return regressions == 0
+
+
+def load(path):
+    with open(path) as f:
+        return json.load(f)
+
+
+def main():
+    if len(sys.argv) == 3 and sys.argv[1] == "summarize":
+        json.dump(summarize(sys.argv[2]), sys.stdout, indent=1)
+        print()
+    elif len(sys.argv) == 3 and sys.argv[1] == "show":
+        show(load(sys.argv[2]))
+    elif len(sys.argv) == 4 and sys.argv[1] == "compare":
+        if not compare(load(sys.argv[2]), load(sys.argv[3])):
+            sys.exit(1)
+    else:
+        sys.stderr.write(__doc__)
+        sys.exit(2)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,50 @@
+#!/bin/bash
+#
+# Boots a VM with virtme-ng (vng) or virtme, runs the benchmark sweep in it
+# with the module from build/, and summarizes the results. If a baseline
+# has been saved in bench/baseline.json, the results are compared against
+# it and the script fails if anything regressed.
+#
+# Usage: bench/run.sh [results_dir]
+#
+# KERNEL is a kernel build tree to boot (the module must be built against
+# it with make KDIR=...); by default the host's kernel is used. CPUS and
+# MEMORY size the VM, and the variables at the top of bench/guest.sh
+# change the sweep.
+
+set -e
+cd "$(dirname "$0")/.."
+
+RESULTS=${1:-build/bench}
+CPUS=${CPUS:-4}
+MEMORY=${MEMORY:-4G}
+
+if [ ! -f build/ram_disk.ko ]; then
+  echo "build/ram_disk.ko is missing; run make first" >&2
+  exit 1
+fi
+rm -rf "$RESULTS"
+mkdir -p "$RESULTS"
+
+GUEST="bench/guest.sh $RESULTS"
+if command -v vng >/dev/null; then
+  vng --run $KERNEL --cpus $CPUS --memory $MEMORY --user root \
+    --rwdir "$RESULTS" --exec "$GUEST"
+elif command -v virtme-run >/dev/null; then
+  if [ -n "$KERNEL" ]; then
+    KERNEL_ARGS="--kdir $KERNEL --mods=auto"
+  else
+    KERNEL_ARGS="--installed-kernel"
+  fi
+  virtme-run $KERNEL_ARGS --rwdir "$RESULTS" --script-sh "$GUEST" \
+    --qemu-opts -smp $CPUS -m $MEMORY
+else
+  echo "install virtme-ng (vng) or virtme to run the benchmarks" >&2
+  exit 1
+fi
+
+python3 bench/report.py summarize "$RESULTS" >"$RESULTS/summary.json"
+python3 bench/report.py show "$RESULTS/summary.json"
+if [ -f bench/baseline.json ]; then
+  python3 bench/report.py compare bench/baseline.json "$RESULTS/summary.json"
+fi
@@ -0,0 +1,346 @@
+#ifndef __RAM_DISK_H__
+#define __RAM_DISK_H__
+
+#include <linux/blk-mq.h>
+#include <linux/blk_types.h>
+#include <linux/crypto.h>
+#include <linux/genhd.h>
+#include <linux/list.h>
+#include <linux/llist.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/types.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
+
+struct address_space;
+struct ram_disk_backing;
+struct ram_disk_comp;
+struct ram_disk_cpu_stats;
+struct ram_disk_dedup;
+struct ram_disk_mem;
+struct seq_file;
+
+#define DRIVER_NAME "ram_disk"
+
+// Minor numbers reserved for each disk, which bounds max_part.
+#define RAM_DISK_MINORS 16
+#define RAM_DISK_MAX_DISKS ((1 << MINORBITS) / RAM_DISK_MINORS)
+
+// Everything that can be chosen when a disk is created. The module
+// parameters fill in the defaults, and configfs lets each disk override
+// them before it is powered on.
+struct ram_disk_config {
+  unsigned long size_mb;
+  unsigned int logical_block_size;
+  unsigned int physical_block_size;
+  unsigned int hw_queues;
+  unsigned int queue_depth;
+  unsigned int poll_queues;
+  unsigned int max_part;
+  bool bio_mode;
+  bool huge_pages;
+  bool dedup;
+
+  // Name of a crypto API compressor such as "lz4" or "zstd", or empty to
+  // store pages uncompressed.
+  char compressor[CRYPTO_MAX_ALG_NAME];
+
+  // One of "local", "interleave" or "bind". numa_node is only used by
+  // "bind", and numa_stripe_kb only by "interleave".
+  char numa_policy[16];
+  int numa_node;
+  unsigned int numa_stripe_kb;
+
+  // File to load the disk from and save it to, or empty to start out
+  // zeroed. Dirty pages are written back every writeback_ms.
+  char backing_file[256];
+  unsigned int writeback_ms;
+
+  // Name of a device to emulate, such as "nvme-gen4" or "sata-ssd", or
+  // empty to run at memory speed. Any of the other values that are
+  // nonzero override the profile's.
+  char profile[16];
+  unsigned int read_latency_us;
+  unsigned int write_latency_us;
+  unsigned int read_mbps;
+  unsigned int write_mbps;
+};
+
+// ram_disk_numa.c
+
+enum ram_disk_numa_policy {
+  RAM_DISK_NUMA_LOCAL,
+  RAM_DISK_NUMA_INTERLEAVE,
+  RAM_DISK_NUMA_BIND,
+};
+
+struct ram_disk_numa_cpu_stats {
+  u64 hit;
+  u64 miss;
+};
+
+struct ram_disk_numa {
+  enum ram_disk_numa_policy policy;
+  int node;
+  unsigned int stripe_shift;
+  int nr_nodes;
+  int* nodes;
+  struct ram_disk_numa_cpu_stats __percpu* stats;
+};
+
+int ram_disk_numa_init(struct ram_disk_numa* numa,
+                       const struct ram_disk_config* config,
+                       gfp_t* gfp);
+void ram_disk_numa_free(struct ram_disk_numa* numa);
+int ram_disk_numa_node(struct ram_disk_numa* numa, pgoff_t index);
+void ram_disk_numa_show(struct seq_file* s, struct ram_disk_numa* numa);
+
+// Called for every access to a stored page, so it's kept inline.
+static inline void ram_disk_numa_account(struct ram_disk_numa* numa,
+                                         struct page* page) {
+  if (page_to_nid(page) == numa_node_id()) {
+    this_cpu_inc(numa->stats->hit);
+  } else {
+    this_cpu_inc(numa->stats->miss);
+  }
+}
+
+// ram_disk_store.c
+
+// Backing memory for one disk. Pages are indexed by their offset in the
+// disk (in units of PAGE_SIZE) and only allocated the first time they are
+// written, so a large disk costs nothing until it is filled.
+struct ram_disk_store {
+  struct xarray pages;
+  size_t size;
+
+  // Flags for allocating pages.
+  gfp_t gfp;
+
+  // Only set in compressed mode, in which case the xarray holds
+  // compressed page handles instead of pages.
+  struct ram_disk_comp* comp;
+
+  // Only set in deduplicated mode.
+  struct ram_disk_dedup* dedup;
+
+  // Number of shared pages that had to be copied because of a write.
+  atomic64_t cow_copies;
+
+  // Set if pages are allocated in 2 MiB chunks when possible. The chunks
+  // that were allocated, and the times one couldn't be, are counted.
+  bool huge;
+  atomic64_t huge_chunks;
+  atomic64_t huge_fallbacks;
+
+  // Number of times a lock in the store was found already held.
+  unsigned long __percpu* contended;
+
+  // Mappings of the store's pages to unmap when they change, and the
+  // zeroed page mapped in place of holes. Set by ram_disk_mem.c.
+  struct address_space* mapping;
+  struct page* hole_page;
+
+  struct ram_disk_numa numa;
+};
+
+int ram_disk_store_init(struct ram_disk_store* store,
+                        const struct ram_disk_config* config);
+void ram_disk_store_free(struct ram_disk_store* store);
+u64 ram_disk_store_contended(struct ram_disk_store* store);
+blk_status_t ram_disk_store_read(struct ram_disk_store* store,
+                                 struct page* page,
+                                 unsigned int offset,
+                                 unsigned int len,
+                                 sector_t sector);
+blk_status_t ram_disk_store_write(struct ram_disk_store* store,
+                                  struct page* page,
+                                  unsigned int offset,
+                                  unsigned int len,
+                                  sector_t sector);
+blk_status_t ram_disk_store_discard(struct ram_disk_store* store,
+                                    sector_t sector,
+                                    unsigned int len);
+struct page* ram_disk_store_map_page(struct ram_disk_store* store,
+                                     pgoff_t index);
+int ram_disk_store_clone(struct ram_disk_store* dst,
+                         struct ram_disk_store* src);
+
+// ram_disk_comp.c
+
+struct ram_disk_comp_stats {
+  const char* algorithm;
+  u64 stored_pages;
+  u64 same_pages;
+  u64 compr_size;
+  u64 compress_ops;
+  u64 compress_ns;
+  u64 decompress_ops;
+  u64 decompress_ns;
+};
+
+int ram_disk_comp_init(struct ram_disk_store* store, const char* algorithm);
+void ram_disk_comp_free(struct ram_disk_store* store);
+blk_status_t ram_disk_comp_read(struct ram_disk_store* store,
+                                struct page* page,
+                                unsigned int offset,
+                                unsigned int len,
+                                sector_t sector);
+blk_status_t ram_disk_comp_write(struct ram_disk_store* store,
+                                 struct page* page,
+                                 unsigned int offset,
+                                 unsigned int len,
+                                 sector_t sector);
+blk_status_t ram_disk_comp_discard(struct ram_disk_store* store,
+                                   sector_t sector,
+                                   unsigned int len);
+void ram_disk_comp_get_stats(struct ram_disk_store* store,
+                             struct ram_disk_comp_stats* stats);
+
+// ram_disk_throttle.c
+
+struct ram_disk_throttle_dir {
+  u64 latency_ns;
+  unsigned int mbps;
+  atomic64_t next_ns;
+};
+
+struct ram_disk_throttle {
+  bool enabled;
+
+  // Queue shape of the emulated device, or zero to use the config's.
+  unsigned int hw_queues;
+  unsigned int queue_depth;
+
+  // Indexed by READ and WRITE.
+  struct ram_disk_throttle_dir dirs[2];
+};
+
+int ram_disk_throttle_init(struct ram_disk_throttle* throttle,
+                           const struct ram_disk_config* config);
+u64 ram_disk_throttle_deadline(struct ram_disk_throttle* throttle,
+                               bool is_write,
+                               unsigned int bytes,
+                               u64 now);
+
+// ram_disk_dedup.c
+
+struct ram_disk_dedup_stats {
+  u64 stored_pages;
+  u64 mem_used;
+  u64 hashed_pages;
+  u64 hash_ns;
+  u64 merged_pages;
+  u64 mismatches;
+};
+
+int ram_disk_dedup_init(struct ram_disk_store* store);
+void ram_disk_dedup_free(struct ram_disk_store* store);
+struct mutex* ram_disk_dedup_stripe(struct ram_disk_store* store,
+                                    pgoff_t index);
+u32 ram_disk_dedup_hash(struct ram_disk_store* store, struct page* page);
+bool ram_disk_dedup_find(struct ram_disk_store* store,
+                         u32 hash,
+                         pgoff_t index,
+                         pgoff_t* match);
+void ram_disk_dedup_mismatch(struct ram_disk_store* store,
+                             u32 hash,
+                             pgoff_t stale,
+                             pgoff_t index);
+void ram_disk_dedup_merged(struct ram_disk_store* store);
+void ram_disk_dedup_get_stats(struct ram_disk_store* store,
+                              struct ram_disk_dedup_stats* stats);
+
+// ram_disk_main.c
+
+struct ram_disk {
+  int id;
+  struct ram_disk_config config;
+  struct ram_disk_store store;
+
+  struct blk_mq_tag_set tag_set;
+  struct request_queue* queue;
+  struct gendisk* disk;
+
+  // Both protected by the module's open lock. A dying disk can't be
+  // opened, and if it's still open it's destroyed after the last release.
+  unsigned int open_count;
+  bool dying;
+  struct work_struct destroy_work;
+
+  struct ram_disk_throttle throttle;
+
+  // Completed requests waiting to be polled, indexed by hardware queue.
+  // Only allocated if config.poll_queues is set.
+  struct llist_head* poll_lists;
+
+  // Set for disks created with RAM_DISK_IOC_SNAPSHOT.
+  bool is_snapshot;
+
+  struct ram_disk_cpu_stats __percpu* stats;
+  struct dentry* debugfs_dir;
+
+  // Only set if config.backing_file is set.
+  struct ram_disk_backing* backing;
+
+  struct ram_disk_mem* mem;
+
+  // Link in the list of disks owned by the module (those created from
+  // module parameters and snapshots).
+  struct list_head link;
+};
+
+void ram_disk_default_config(struct ram_disk_config* config);
+struct ram_disk* ram_disk_create(const struct ram_disk_config* config);
+struct ram_disk* ram_disk_create_snapshot(struct ram_disk* origin);
+int ram_disk_begin_destroy(struct ram_disk* dev);
+void ram_disk_destroy(struct ram_disk* dev);
+void ram_disk_remove(struct ram_disk* dev);
+
+// ram_disk_mem.c
+int ram_disk_mem_init(struct ram_disk* dev);
+void ram_disk_mem_free(struct ram_disk* dev);
+int ram_disk_mem_module_init(void);
+void ram_disk_mem_module_exit(void);
+
+// ram_disk_backing.c
+int ram_disk_backing_init(struct ram_disk* dev);
+void ram_disk_backing_free(struct ram_disk* dev);
+void ram_disk_backing_mark_dirty(struct ram_disk* dev,
+                                 sector_t sector,
+                                 unsigned int len);
+u64 ram_disk_backing_flushed_pages(struct ram_disk* dev);
+
+// ram_disk_stats.c
+
+enum ram_disk_stat_op {
+  RAM_DISK_STAT_READ,
+  RAM_DISK_STAT_WRITE,
+  RAM_DISK_STAT_DISCARD,
+  RAM_DISK_STAT_OTHER,
+  RAM_DISK_STAT_NR_OPS,
+};
+
+// Number of buckets in each log2 histogram.
+#define RAM_DISK_STAT_BUCKETS 32
+
+int ram_disk_stats_init(struct ram_disk* dev);
+void ram_disk_stats_register(struct ram_disk* dev);
+void ram_disk_stats_free(struct ram_disk* dev);
+void ram_disk_stats_account(struct ram_disk* dev,
+                            unsigned int op,
+                            unsigned int bytes,
+                            unsigned int segments,
+                            u64 start_ns);
+void ram_disk_stats_module_init(void);
+void ram_disk_stats_module_exit(void);
+
+// ram_disk_sysfs.c
+extern const struct attribute_group* ram_disk_attr_groups[];
+
+// ram_disk_configfs.c
+int ram_disk_configfs_init(void);
+void ram_disk_configfs_exit(void);
+
+#endif
@@ -0,0 +1,223 @@
+#include <linux/bitmap.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include "ram_disk.h"
+
+// A disk with a backing file loads its contents from the file when it is
+// created, and saves them back when it is destroyed. In between, I/O only
+// touches memory: writes set a bit per page in a dirty bitmap, and a
+// background worker periodically copies runs of dirty pages out to the
+// file in large sequential writes.
+//
+// Anything written after the last flush is lost if the machine crashes,
+// but a clean unload (or destroying the disk) always writes everything.
+
+// Largest single read or write to the backing file.
+#define RAM_DISK_BACKING_BATCH (1 << 20)
+
+struct ram_disk_backing {
+  struct ram_disk* dev;
+  struct file* file;
+  unsigned long* dirty;
+  unsigned long nr_pages;
+  unsigned long interval;
+  struct delayed_work work;
+
+  // Staging buffer for batches, only used by one load or flush at a time.
+  struct mutex buffer_lock;
+  u8* buffer;
+
+  atomic64_t flushed_pages;
+};
+
+static void flush_work_fn(struct work_struct* work);
+
+static int load_file(struct ram_disk_backing* backing) {
+  struct ram_disk_store* store = &backing->dev->store;
+  loff_t pos = 0;
+  while (pos < store->size) {
+    size_t want = min_t(size_t, RAM_DISK_BACKING_BATCH, store->size - pos);
+    loff_t read_pos = pos;
+    ssize_t got = kernel_read(backing->file, backing->buffer, want, &read_pos);
+    size_t off;
+    if (got < 0) {
+      return got;
+    }
+    for (off = 0; off + PAGE_SIZE <= got; off += PAGE_SIZE) {
+      u8* data = backing->buffer + off;
+      blk_status_t status;
+      if (!memchr_inv(data, 0, PAGE_SIZE)) {
+        // Leave zero pages out of the store.
+        continue;
+      }
+      status = ram_disk_store_write(store, vmalloc_to_page(data), 0, PAGE_SIZE,
+                                    (pos + off) >> SECTOR_SHIFT);
+      if (status) {
+        return blk_status_to_errno(status);
+      }
+    }
+    if (got < want) {
+      // The rest of the file is missing, so it reads as zeroes.
+      break;
+    }
+    pos += got;
+  }
+  return 0;
+}
+
+// Write out every page that was dirty when this started.
+static int flush_dirty(struct ram_disk_backing* backing) {
+  struct ram_disk_store* store = &backing->dev->store;
+  unsigned long batch_pages = RAM_DISK_BACKING_BATCH >> PAGE_SHIFT;
+  unsigned long start = 0;
+  int res = 0;
+
+  mutex_lock(&backing->buffer_lock);
+  for (;;) {
+    unsigned long end;
+    unsigned long i;
+    loff_t pos;
+    ssize_t written;
+
+    start = find_next_bit(backing->dirty, backing->nr_pages, start);
+    if (start >= backing->nr_pages) {
+      break;
+    }
+    end = find_next_zero_bit(backing->dirty, backing->nr_pages, start);
+    end = min(end, start + batch_pages);
+
+    // Clear the bits before copying, so a write that races with the copy
+    // dirties the page again and gets flushed next time.
+    for (i = start; i < end; ++i) {
+      clear_bit(i, backing->dirty);
+    }
+    for (i = start; i < end; ++i) {
+      u8* data = backing->buffer + ((i - start) << PAGE_SHIFT);
+      ram_disk_store_read(store, vmalloc_to_page(data), 0, PAGE_SIZE,
+                          (sector_t)i << (PAGE_SHIFT - SECTOR_SHIFT));
+    }
+
+    pos = (loff_t)start << PAGE_SHIFT;
+    written = kernel_write(backing->file, backing->buffer,
+                           (end - start) << PAGE_SHIFT, &pos);
+    if (written != (end - start) << PAGE_SHIFT) {
+      // Try these pages again next time.
+      for (i = start; i < end; ++i) {
+        set_bit(i, backing->dirty);
+      }
+      res = written < 0 ? written : -EIO;
+      break;
+    }
+    atomic64_add(end - start, &backing->flushed_pages);
+    start = end;
+  }
+  mutex_unlock(&backing->buffer_lock);
+  return res;
+}
+
+static void flush_work_fn(struct work_struct* work) {
+  struct ram_disk_backing* backing =
+      container_of(to_delayed_work(work), struct ram_disk_backing, work);
+  int res = flush_dirty(backing);
+  if (res) {
+    printk(KERN_WARNING "ram_disk: writeback to backing file failed: %d\n",
+           res);
+  }
+  queue_delayed_work(system_unbound_wq, &backing->work, backing->interval);
+}
+
+int ram_disk_backing_init(struct ram_disk* dev) {
+  struct ram_disk_backing* backing;
+  int res;
+
+  backing = kzalloc(sizeof(struct ram_disk_backing), GFP_KERNEL);
+  if (!backing) {
+    return -ENOMEM;
+  }
+  backing->dev = dev;
+  backing->nr_pages = DIV_ROUND_UP(dev->store.size, PAGE_SIZE);
+  backing->interval = msecs_to_jiffies(dev->config.writeback_ms);
+  mutex_init(&backing->buffer_lock);
+  INIT_DELAYED_WORK(&backing->work, flush_work_fn);
+
+  res = -ENOMEM;
+  backing->dirty = kvcalloc(BITS_TO_LONGS(backing->nr_pages),
+                            sizeof(unsigned long), GFP_KERNEL);
+  backing->buffer = vmalloc(RAM_DISK_BACKING_BATCH);
+  if (!backing->dirty || !backing->buffer) {
+    goto fail;
+  }
+
+  backing->file = filp_open(dev->config.backing_file,
+                            O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+  if (IS_ERR(backing->file)) {
+    res = PTR_ERR(backing->file);
+    goto fail;
+  }
+
+  res = load_file(backing);
+  if (res) {
+    filp_close(backing->file, NULL);
+    goto fail;
+  }
+
+  dev->backing = backing;
+  queue_delayed_work(system_unbound_wq, &backing->work, backing->interval);
+  return 0;
+
+fail:
+  vfree(backing->buffer);
+  kvfree(backing->dirty);
+  kfree(backing);
+  return res;
+}
+
+// Called once no more I/O can arrive, so the final flush gets everything.
+void ram_disk_backing_free(struct ram_disk* dev) {
+  struct ram_disk_backing* backing = dev->backing;
+  int res;
+  if (!backing) {
+    return;
+  }
+  cancel_delayed_work_sync(&backing->work);
+  res = flush_dirty(backing);
+  if (!res) {
+    res = vfs_fsync(backing->file, 0);
+  }
+  if (res) {
+    printk(KERN_WARNING "ram_disk: failed to save %s: %d\n",
+           dev->config.backing_file, res);
+  }
+  filp_close(backing->file, NULL);
+  vfree(backing->buffer);
+  kvfree(backing->dirty);
+  kfree(backing);
+  dev->backing = NULL;
+}
+
+void ram_disk_backing_mark_dirty(struct ram_disk* dev,
+                                 sector_t sector,
+                                 unsigned int len) {
+  struct ram_disk_backing* backing = dev->backing;
+  size_t pos = (size_t)sector << SECTOR_SHIFT;
+  unsigned long first = pos >> PAGE_SHIFT;
+  unsigned long last = (pos + len - 1) >> PAGE_SHIFT;
+  unsigned long i;
+  if (!len) {
+    return;
+  }
+  for (i = first; i <= last && i < backing->nr_pages; ++i) {
+    if (!test_bit(i, backing->dirty)) {
+      set_bit(i, backing->dirty);
+    }
+  }
+}
+
+u64 ram_disk_backing_flushed_pages(struct ram_disk* dev) {
+  return atomic64_read(&dev->backing->flushed_pages);
+}
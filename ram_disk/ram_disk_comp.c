@@ -0,0 +1,409 @@
+#include <linux/crypto.h>
+#include <linux/highmem.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include "ram_disk.h"
+
+// In compressed mode, each xarray entry is a handle for one page of the
+// disk instead of the page itself:
+//
+//  * A value entry (xa_mk_value) is a page filled with one repeated word.
+//  * Anything else is a struct ram_disk_comp_page holding the compressed
+//    bytes, or the raw page if it didn't compress.
+//
+// Handles are replaced rather than modified, and every access to a handle
+// holds the lock for its stripe, so they can be freed right away.
+
+#define RAM_DISK_COMP_STRIPES 256
+
+struct ram_disk_comp_page {
+  unsigned int len;
+  u8 data[];
+};
+
+// Compression contexts aren't safe to share, so each CPU gets its own,
+// along with scratch space for a whole page and its compressed form.
+struct ram_disk_comp_stream {
+  struct mutex lock;
+  struct crypto_comp* tfm;
+  u8* page;
+  u8* buffer;
+};
+
+struct ram_disk_comp {
+  struct mutex locks[RAM_DISK_COMP_STRIPES];
+  struct ram_disk_comp_stream __percpu* streams;
+  char algorithm[CRYPTO_MAX_ALG_NAME];
+
+  atomic64_t stored_pages;
+  atomic64_t same_pages;
+  atomic64_t compr_size;
+  atomic64_t compress_ops;
+  atomic64_t compress_ns;
+  atomic64_t decompress_ops;
+  atomic64_t decompress_ns;
+};
+
+static void free_streams(struct ram_disk_comp* comp) {
+  int cpu;
+  for_each_possible_cpu(cpu) {
+    struct ram_disk_comp_stream* stream = per_cpu_ptr(comp->streams, cpu);
+    if (stream->tfm) {
+      crypto_free_comp(stream->tfm);
+    }
+    kfree(stream->page);
+    kfree(stream->buffer);
+  }
+  free_percpu(comp->streams);
+}
+
+int ram_disk_comp_init(struct ram_disk_store* store, const char* algorithm) {
+  struct ram_disk_comp* comp;
+  int cpu;
+  int i;
+
+  if (!crypto_has_comp(algorithm, 0, 0)) {
+    printk(KERN_WARNING "ram_disk: unknown compressor %s\n", algorithm);
+    return -EINVAL;
+  }
+
+  comp = kzalloc(sizeof(struct ram_disk_comp), GFP_KERNEL);
+  if (!comp) {
+    return -ENOMEM;
+  }
+  strscpy(comp->algorithm, algorithm, sizeof(comp->algorithm));
+  for (i = 0; i < RAM_DISK_COMP_STRIPES; ++i) {
+    mutex_init(&comp->locks[i]);
+  }
+
+  comp->streams = alloc_percpu(struct ram_disk_comp_stream);
+  if (!comp->streams) {
+    kfree(comp);
+    return -ENOMEM;
+  }
+  for_each_possible_cpu(cpu) {
+    struct ram_disk_comp_stream* stream = per_cpu_ptr(comp->streams, cpu);
+    mutex_init(&stream->lock);
+    stream->tfm = crypto_alloc_comp(algorithm, 0, 0);
+    if (IS_ERR(stream->tfm)) {
+      stream->tfm = NULL;
+      goto fail;
+    }
+    stream->page = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    // Some compressors need room to expand incompressible input.
+    stream->buffer = kmalloc(PAGE_SIZE * 2, GFP_KERNEL);
+    if (!stream->page || !stream->buffer) {
+      goto fail;
+    }
+  }
+
+  store->comp = comp;
+  return 0;
+
+fail:
+  free_streams(comp);
+  kfree(comp);
+  return -ENOMEM;
+}
+
+static void free_handle(void* entry) {
+  if (entry && !xa_is_value(entry)) {
+    kfree(entry);
+  }
+}
+
+void ram_disk_comp_free(struct ram_disk_store* store) {
+  void* entry;
+  unsigned long index;
+  if (!store->comp) {
+    return;
+  }
+  xa_for_each(&store->pages, index, entry) {
+    free_handle(entry);
+  }
+  free_streams(store->comp);
+  kfree(store->comp);
+  store->comp = NULL;
+}
+
+// Lock the stripe of an index. Consecutive pages fall in different stripes,
+// so even a single large request only holds one stripe at a time.
+static struct mutex* lock_stripe(struct ram_disk_store* store, pgoff_t index) {
+  struct mutex* lock = &store->comp->locks[index % RAM_DISK_COMP_STRIPES];
+  if (!mutex_trylock(lock)) {
+    this_cpu_inc(*store->contended);
+    mutex_lock(lock);
+  }
+  return lock;
+}
+
+static struct ram_disk_comp_stream* get_stream(struct ram_disk_comp* comp) {
+  // The task may migrate after this, in which case it simply keeps using
+  // the stream of the CPU it started on.
+  struct ram_disk_comp_stream* stream = raw_cpu_ptr(comp->streams);
+  mutex_lock(&stream->lock);
+  return stream;
+}
+
+static void put_stream(struct ram_disk_comp_stream* stream) {
+  mutex_unlock(&stream->lock);
+}
+
+static void fill_words(u8* dst, unsigned long word, unsigned int len) {
+  memset_l((unsigned long*)dst, word, len / sizeof(unsigned long));
+}
+
+static bool page_is_same_filled(const u8* data, unsigned long* word) {
+  const unsigned long* words = (const unsigned long*)data;
+  unsigned int i;
+  for (i = 1; i < PAGE_SIZE / sizeof(unsigned long); ++i) {
+    if (words[i] != words[0]) {
+      return false;
+    }
+  }
+  *word = words[0];
+  return true;
+}
+
+static void account(struct ram_disk_comp* comp, void* entry, long sign) {
+  struct ram_disk_comp_page* zpage = entry;
+  if (!entry) {
+    return;
+  }
+  atomic64_add(sign, &comp->stored_pages);
+  if (xa_is_value(entry)) {
+    atomic64_add(sign, &comp->same_pages);
+  } else {
+    atomic64_add(sign * zpage->len, &comp->compr_size);
+  }
+}
+
+// Decode the whole page at an index into dst. The stripe lock must be held.
+static int load_page(struct ram_disk_comp* comp,
+                     struct ram_disk_comp_stream* stream,
+                     void* entry,
+                     u8* dst) {
+  struct ram_disk_comp_page* zpage = entry;
+  unsigned int dlen = PAGE_SIZE;
+  u64 start;
+  int res;
+  if (!entry) {
+    memset(dst, 0, PAGE_SIZE);
+    return 0;
+  }
+  if (xa_is_value(entry)) {
+    fill_words(dst, xa_to_value(entry), PAGE_SIZE);
+    return 0;
+  }
+  if (zpage->len == PAGE_SIZE) {
+    memcpy(dst, zpage->data, PAGE_SIZE);
+    return 0;
+  }
+  start = ktime_get_ns();
+  res = crypto_comp_decompress(stream->tfm, zpage->data, zpage->len, dst,
+                               &dlen);
+  atomic64_add(ktime_get_ns() - start, &comp->decompress_ns);
+  atomic64_inc(&comp->decompress_ops);
+  if (!res && dlen != PAGE_SIZE) {
+    res = -EIO;
+  }
+  return res;
+}
+
+// Replace the handle at an index with an encoding of src. The stripe lock
+// must be held.
+static int save_page(struct ram_disk_store* store,
+                     struct ram_disk_comp_stream* stream,
+                     pgoff_t index,
+                     const u8* src) {
+  struct ram_disk_comp* comp = store->comp;
+  struct ram_disk_comp_page* zpage;
+  unsigned int dlen = PAGE_SIZE * 2;
+  unsigned long word;
+  void* entry;
+  void* old;
+  u64 start;
+  int res;
+
+  if (page_is_same_filled(src, &word) && word <= LONG_MAX) {
+    if (!word) {
+      // All zeroes, which is what a missing page reads as anyway.
+      entry = NULL;
+    } else {
+      entry = xa_mk_value(word);
+    }
+  } else {
+    start = ktime_get_ns();
+    res = crypto_comp_compress(stream->tfm, src, PAGE_SIZE, stream->buffer,
+                               &dlen);
+    atomic64_add(ktime_get_ns() - start, &comp->compress_ns);
+    atomic64_inc(&comp->compress_ops);
+    if (res || dlen >= PAGE_SIZE) {
+      dlen = PAGE_SIZE;
+    }
+    zpage = kmalloc_node(struct_size(zpage, data, dlen), GFP_NOIO,
+                         ram_disk_numa_node(&store->numa, index));
+    if (!zpage) {
+      return -ENOMEM;
+    }
+    zpage->len = dlen;
+    memcpy(zpage->data, dlen == PAGE_SIZE ? src : stream->buffer, dlen);
+    entry = zpage;
+  }
+
+  old = xa_store(&store->pages, index, entry, GFP_NOIO);
+  if (xa_is_err(old)) {
+    free_handle(entry);
+    return xa_err(old);
+  }
+  account(comp, old, -1);
+  account(comp, entry, 1);
+  free_handle(old);
+  return 0;
+}
+
+blk_status_t ram_disk_comp_read(struct ram_disk_store* store,
+                                struct page* page,
+                                unsigned int offset,
+                                unsigned int len,
+                                sector_t sector) {
+  struct ram_disk_comp* comp = store->comp;
+  size_t pos = (size_t)sector << SECTOR_SHIFT;
+  blk_status_t status = BLK_STS_OK;
+  u8* dst = kmap(page);
+  while (len) {
+    pgoff_t index = pos >> PAGE_SHIFT;
+    unsigned int page_off = offset_in_page(pos);
+    unsigned int chunk = min_t(unsigned int, len, PAGE_SIZE - page_off);
+    struct mutex* lock = lock_stripe(store, index);
+    void* entry;
+    entry = xa_load(&store->pages, index);
+    if (!entry) {
+      memset(dst + offset, 0, chunk);
+    } else if (xa_is_value(entry)) {
+      fill_words(dst + offset, xa_to_value(entry), chunk);
+    } else {
+      struct ram_disk_comp_stream* stream = get_stream(comp);
+      int res;
+      ram_disk_numa_account(&store->numa, virt_to_page(entry));
+      if (chunk == PAGE_SIZE) {
+        res = load_page(comp, stream, entry, dst + offset);
+      } else {
+        res = load_page(comp, stream, entry, stream->page);
+        memcpy(dst + offset, stream->page + page_off, chunk);
+      }
+      put_stream(stream);
+      if (res) {
+        status = BLK_STS_IOERR;
+      }
+    }
+    mutex_unlock(lock);
+    if (status) {
+      break;
+    }
+    pos += chunk;
+    offset += chunk;
+    len -= chunk;
+  }
+  kunmap(page);
+  return status;
+}
+
+// Write part of a page. A NULL src writes zeroes.
+static int write_chunk(struct ram_disk_store* store,
+                       pgoff_t index,
+                       unsigned int page_off,
+                       const u8* src,
+                       unsigned int chunk) {
+  struct ram_disk_comp* comp = store->comp;
+  struct mutex* lock = lock_stripe(store, index);
+  struct ram_disk_comp_stream* stream;
+  void* entry;
+  int res = 0;
+
+  entry = xa_load(&store->pages, index);
+  if (!src && (chunk == PAGE_SIZE || !entry)) {
+    // Zeroing a whole page, or part of a page that is already zero.
+    if (entry) {
+      xa_erase(&store->pages, index);
+      account(comp, entry, -1);
+      free_handle(entry);
+    }
+    mutex_unlock(lock);
+    return 0;
+  }
+
+  stream = get_stream(comp);
+  if (chunk != PAGE_SIZE) {
+    res = load_page(comp, stream, entry, stream->page);
+  }
+  if (!res) {
+    if (src) {
+      memcpy(stream->page + page_off, src, chunk);
+    } else {
+      memset(stream->page + page_off, 0, chunk);
+    }
+    res = save_page(store, stream, index, stream->page);
+  }
+  put_stream(stream);
+  mutex_unlock(lock);
+  return res;
+}
+
+blk_status_t ram_disk_comp_write(struct ram_disk_store* store,
+                                 struct page* page,
+                                 unsigned int offset,
+                                 unsigned int len,
+                                 sector_t sector) {
+  size_t pos = (size_t)sector << SECTOR_SHIFT;
+  int res = 0;
+  u8* src = kmap(page);
+  while (len) {
+    unsigned int page_off = offset_in_page(pos);
+    unsigned int chunk = min_t(unsigned int, len, PAGE_SIZE - page_off);
+    res = write_chunk(store, pos >> PAGE_SHIFT, page_off, src + offset, chunk);
+    if (res) {
+      break;
+    }
+    pos += chunk;
+    offset += chunk;
+    len -= chunk;
+  }
+  kunmap(page);
+  return errno_to_blk_status(res);
+}
+
+blk_status_t ram_disk_comp_discard(struct ram_disk_store* store,
+                                   sector_t sector,
+                                   unsigned int len) {
+  size_t pos = (size_t)sector << SECTOR_SHIFT;
+  size_t end = pos + len;
+  while (pos < end) {
+    unsigned int page_off = offset_in_page(pos);
+    unsigned int chunk = min_t(size_t, end - pos, PAGE_SIZE - page_off);
+    int res = write_chunk(store, pos >> PAGE_SHIFT, page_off, NULL, chunk);
+    if (res) {
+      return errno_to_blk_status(res);
+    }
+    pos += chunk;
+  }
+  return BLK_STS_OK;
+}
+
+void ram_disk_comp_get_stats(struct ram_disk_store* store,
+                             struct ram_disk_comp_stats* stats) {
+  struct ram_disk_comp* comp = store->comp;
+  stats->algorithm = comp->algorithm;
+  stats->stored_pages = atomic64_read(&comp->stored_pages);
+  stats->same_pages = atomic64_read(&comp->same_pages);
+  stats->compr_size = atomic64_read(&comp->compr_size);
+  stats->compress_ops = atomic64_read(&comp->compress_ops);
+  stats->compress_ns = atomic64_read(&comp->compress_ns);
+  stats->decompress_ops = atomic64_read(&comp->decompress_ops);
+  stats->decompress_ns = atomic64_read(&comp->decompress_ns);
+}
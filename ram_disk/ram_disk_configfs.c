@@ -0,0 +1,248 @@
+#include <linux/configfs.h>
+#include <linux/err.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include "ram_disk.h"
+
+// Disks can be created at runtime through configfs:
+//
+//   mkdir /sys/kernel/config/ram_disk/scratch
+//   echo 4096 >/sys/kernel/config/ram_disk/scratch/size_mb
+//   echo 1 >/sys/kernel/config/ram_disk/scratch/power
+//
+// Attributes can only be changed while the disk is powered off, and
+// removing the directory destroys the disk (once it's closed, if it's in
+// use).
+
+struct ram_disk_item {
+  struct config_item item;
+
+  // Protects config and dev.
+  struct mutex lock;
+  struct ram_disk_config config;
+  struct ram_disk* dev;
+};
+
+static struct ram_disk_item* to_ram_disk_item(struct config_item* item) {
+  return container_of(item, struct ram_disk_item, item);
+}
+
+#define RAM_DISK_ATTR_BODY(name, type, parse)                                 \
+  static ssize_t ram_disk_##name##_show(struct config_item* item,             \
+                                        char* page) {                         \
+    struct ram_disk_item* rd = to_ram_disk_item(item);                        \
+    return sprintf(page, "%lld\n", (long long)rd->config.name);              \
+  }                                                                           \
+  static ssize_t ram_disk_##name##_store(struct config_item* item,            \
+                                         const char* page, size_t count) {    \
+    struct ram_disk_item* rd = to_ram_disk_item(item);                        \
+    type value;                                                               \
+    int res = parse(page, 0, &value);                                         \
+    if (res) {                                                                \
+      return res;                                                             \
+    }                                                                         \
+    mutex_lock(&rd->lock);                                                    \
+    if (rd->dev) {                                                            \
+      res = -EBUSY;                                                           \
+    } else {                                                                  \
+      rd->config.name = value;                                                \
+    }                                                                         \
+    mutex_unlock(&rd->lock);                                                  \
+    return res ? res : count;                                                 \
+  }                                                                           \
+  CONFIGFS_ATTR(ram_disk_, name)
+
+#define RAM_DISK_UINT_ATTR(name) \
+  RAM_DISK_ATTR_BODY(name, unsigned int, kstrtouint)
+#define RAM_DISK_INT_ATTR(name) RAM_DISK_ATTR_BODY(name, int, kstrtoint)
+#define RAM_DISK_ULONG_ATTR(name) \
+  RAM_DISK_ATTR_BODY(name, unsigned long, kstrtoul)
+#define RAM_DISK_BOOL_ATTR(name) RAM_DISK_ATTR_BODY(name, bool, kstrtobool_base)
+
+#define RAM_DISK_STRING_ATTR(name)                                            \
+  static ssize_t ram_disk_##name##_show(struct config_item* item,             \
+                                        char* page) {                         \
+    struct ram_disk_item* rd = to_ram_disk_item(item);                        \
+    return sprintf(page, "%s\n", rd->config.name);                            \
+  }                                                                           \
+  static ssize_t ram_disk_##name##_store(struct config_item* item,            \
+                                         const char* page, size_t count) {    \
+    struct ram_disk_item* rd = to_ram_disk_item(item);                        \
+    int res = 0;                                                              \
+    mutex_lock(&rd->lock);                                                    \
+    if (rd->dev) {                                                            \
+      res = -EBUSY;                                                           \
+    } else {                                                                  \
+      strscpy(rd->config.name, page, sizeof(rd->config.name));               \
+      strim(rd->config.name);                                                 \
+    }                                                                         \
+    mutex_unlock(&rd->lock);                                                  \
+    return res ? res : count;                                                 \
+  }                                                                           \
+  CONFIGFS_ATTR(ram_disk_, name)
+
+// Lets kstrtobool() be used in RAM_DISK_ATTR_BODY like the other parsers.
+static int kstrtobool_base(const char* s, unsigned int base, bool* res) {
+  return kstrtobool(s, res);
+}
+
+RAM_DISK_ULONG_ATTR(size_mb);
+RAM_DISK_UINT_ATTR(logical_block_size);
+RAM_DISK_UINT_ATTR(physical_block_size);
+RAM_DISK_UINT_ATTR(hw_queues);
+RAM_DISK_UINT_ATTR(queue_depth);
+RAM_DISK_UINT_ATTR(poll_queues);
+RAM_DISK_UINT_ATTR(max_part);
+RAM_DISK_BOOL_ATTR(bio_mode);
+RAM_DISK_BOOL_ATTR(huge_pages);
+RAM_DISK_BOOL_ATTR(dedup);
+RAM_DISK_INT_ATTR(numa_node);
+RAM_DISK_UINT_ATTR(numa_stripe_kb);
+RAM_DISK_UINT_ATTR(writeback_ms);
+RAM_DISK_UINT_ATTR(read_latency_us);
+RAM_DISK_UINT_ATTR(write_latency_us);
+RAM_DISK_UINT_ATTR(read_mbps);
+RAM_DISK_UINT_ATTR(write_mbps);
+
+static ssize_t ram_disk_power_show(struct config_item* item, char* page) {
+  struct ram_disk_item* rd = to_ram_disk_item(item);
+  return sprintf(page, "%d\n", rd->dev ? 1 : 0);
+}
+
+static ssize_t ram_disk_power_store(struct config_item* item,
+                                    const char* page,
+                                    size_t count) {
+  struct ram_disk_item* rd = to_ram_disk_item(item);
+  bool power;
+  int res = kstrtobool(page, &power);
+  if (res) {
+    return res;
+  }
+  mutex_lock(&rd->lock);
+  if (power && !rd->dev) {
+    struct ram_disk* dev = ram_disk_create(&rd->config);
+    if (IS_ERR(dev)) {
+      res = PTR_ERR(dev);
+    } else {
+      rd->dev = dev;
+    }
+  } else if (!power && rd->dev) {
+    res = ram_disk_begin_destroy(rd->dev);
+    if (!res) {
+      ram_disk_destroy(rd->dev);
+      rd->dev = NULL;
+    }
+  }
+  mutex_unlock(&rd->lock);
+  return res ? res : count;
+}
+
+CONFIGFS_ATTR(ram_disk_, power);
+
+RAM_DISK_STRING_ATTR(compressor);
+RAM_DISK_STRING_ATTR(numa_policy);
+RAM_DISK_STRING_ATTR(backing_file);
+RAM_DISK_STRING_ATTR(profile);
+
+static ssize_t ram_disk_name_show(struct config_item* item, char* page) {
+  struct ram_disk_item* rd = to_ram_disk_item(item);
+  ssize_t res = 0;
+  mutex_lock(&rd->lock);
+  if (rd->dev) {
+    res = sprintf(page, "%s\n", rd->dev->disk->disk_name);
+  }
+  mutex_unlock(&rd->lock);
+  return res;
+}
+
+CONFIGFS_ATTR_RO(ram_disk_, name);
+
+static struct configfs_attribute* ram_disk_item_attrs[] = {
+    &ram_disk_attr_size_mb,
+    &ram_disk_attr_logical_block_size,
+    &ram_disk_attr_physical_block_size,
+    &ram_disk_attr_hw_queues,
+    &ram_disk_attr_queue_depth,
+    &ram_disk_attr_poll_queues,
+    &ram_disk_attr_max_part,
+    &ram_disk_attr_bio_mode,
+    &ram_disk_attr_huge_pages,
+    &ram_disk_attr_dedup,
+    &ram_disk_attr_compressor,
+    &ram_disk_attr_numa_policy,
+    &ram_disk_attr_numa_node,
+    &ram_disk_attr_numa_stripe_kb,
+    &ram_disk_attr_backing_file,
+    &ram_disk_attr_writeback_ms,
+    &ram_disk_attr_profile,
+    &ram_disk_attr_read_latency_us,
+    &ram_disk_attr_write_latency_us,
+    &ram_disk_attr_read_mbps,
+    &ram_disk_attr_write_mbps,
+    &ram_disk_attr_power,
+    &ram_disk_attr_name,
+    NULL,
+};
+
+static void ram_disk_item_release(struct config_item* item) {
+  struct ram_disk_item* rd = to_ram_disk_item(item);
+  // rmdir can't fail, so a disk that's still open outlives its item.
+  if (rd->dev) {
+    ram_disk_remove(rd->dev);
+  }
+  kfree(rd);
+}
+
+static struct configfs_item_operations ram_disk_item_ops = {
+    .release = ram_disk_item_release,
+};
+
+static const struct config_item_type ram_disk_item_type = {
+    .ct_item_ops = &ram_disk_item_ops,
+    .ct_attrs = ram_disk_item_attrs,
+    .ct_owner = THIS_MODULE,
+};
+
+static struct config_item* ram_disk_make_item(struct config_group* group,
+                                              const char* name) {
+  struct ram_disk_item* rd = kzalloc(sizeof(struct ram_disk_item), GFP_KERNEL);
+  if (!rd) {
+    return ERR_PTR(-ENOMEM);
+  }
+  mutex_init(&rd->lock);
+  ram_disk_default_config(&rd->config);
+  config_item_init_type_name(&rd->item, name, &ram_disk_item_type);
+  return &rd->item;
+}
+
+static struct configfs_group_operations ram_disk_group_ops = {
+    .make_item = ram_disk_make_item,
+};
+
+static const struct config_item_type ram_disk_group_type = {
+    .ct_group_ops = &ram_disk_group_ops,
+    .ct_owner = THIS_MODULE,
+};
+
+static struct configfs_subsystem ram_disk_subsys = {
+    .su_group =
+        {
+            .cg_item =
+                {
+                    .ci_namebuf = DRIVER_NAME,
+                    .ci_type = &ram_disk_group_type,
+                },
+        },
+};
+
+int ram_disk_configfs_init(void) {
+  config_group_init(&ram_disk_subsys.su_group);
+  mutex_init(&ram_disk_subsys.su_mutex);
+  return configfs_register_subsystem(&ram_disk_subsys);
+}
+
+void ram_disk_configfs_exit(void) {
+  configfs_unregister_subsystem(&ram_disk_subsys);
+}
@@ -0,0 +1,203 @@
+#include <linux/highmem.h>
+#include <linux/jhash.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/xarray.h>
+#include "ram_disk.h"
+
+// Content table for deduplicated stores. Every page written is hashed,
+// and the table maps each hash to one index of the store whose page has
+// that content (its representative). When a written page matches one in
+// the table, the store drops its own copy and shares the existing page
+// instead, using the same reference counting as snapshots, so a later
+// write to either index copies the page first.
+//
+// The table refers to indices rather than pages, so it never holds pages
+// alive and never has to hear about pages being freed. An entry goes
+// stale when its index is rewritten (in which case the entry is replaced)
+// or discarded, which is only noticed when a lookup compares contents and
+// finds them different.
+//
+// Writers hold the lock for their index's stripe from when they modify a
+// page until they are done merging it, which guarantees that a page being
+// compared isn't also being written in place.
+
+#define RAM_DISK_DEDUP_STRIPES 256
+
+struct ram_disk_dedup_entry {
+  struct hlist_node node;
+  u32 hash;
+  pgoff_t index;
+};
+
+struct ram_disk_dedup {
+  struct mutex locks[RAM_DISK_DEDUP_STRIPES];
+
+  // Protects the buckets and the entries, using the lock of entries.
+  struct hlist_head* buckets;
+  unsigned int bucket_bits;
+  // Entries by the index they represent.
+  struct xarray entries;
+
+  atomic64_t hashed_pages;
+  atomic64_t hash_ns;
+  atomic64_t merged_pages;
+  atomic64_t mismatches;
+};
+
+int ram_disk_dedup_init(struct ram_disk_store* store) {
+  struct ram_disk_dedup* dedup;
+  size_t nr_pages = DIV_ROUND_UP(store->size, PAGE_SIZE);
+  int i;
+
+  dedup = kzalloc(sizeof(struct ram_disk_dedup), GFP_KERNEL);
+  if (!dedup) {
+    return -ENOMEM;
+  }
+  for (i = 0; i < RAM_DISK_DEDUP_STRIPES; ++i) {
+    mutex_init(&dedup->locks[i]);
+  }
+  // About one bucket for every four pages.
+  dedup->bucket_bits = max(ilog2(max_t(size_t, nr_pages / 4, 1)), 10);
+  dedup->buckets = kvcalloc(1UL << dedup->bucket_bits,
+                            sizeof(struct hlist_head), GFP_KERNEL);
+  if (!dedup->buckets) {
+    kfree(dedup);
+    return -ENOMEM;
+  }
+  xa_init(&dedup->entries);
+  store->dedup = dedup;
+  return 0;
+}
+
+void ram_disk_dedup_free(struct ram_disk_store* store) {
+  struct ram_disk_dedup_entry* entry;
+  unsigned long index;
+  if (!store->dedup) {
+    return;
+  }
+  xa_for_each(&store->dedup->entries, index, entry) {
+    kfree(entry);
+  }
+  xa_destroy(&store->dedup->entries);
+  kvfree(store->dedup->buckets);
+  kfree(store->dedup);
+  store->dedup = NULL;
+}
+
+struct mutex* ram_disk_dedup_stripe(struct ram_disk_store* store,
+                                    pgoff_t index) {
+  return &store->dedup->locks[index % RAM_DISK_DEDUP_STRIPES];
+}
+
+u32 ram_disk_dedup_hash(struct ram_disk_store* store, struct page* page) {
+  struct ram_disk_dedup* dedup = store->dedup;
+  u64 start = ktime_get_ns();
+  u32* data = kmap_atomic(page);
+  u32 hash = jhash2(data, PAGE_SIZE / sizeof(u32), 0);
+  kunmap_atomic(data);
+  atomic64_add(ktime_get_ns() - start, &dedup->hash_ns);
+  atomic64_inc(&dedup->hashed_pages);
+  return hash;
+}
+
+static struct hlist_head* bucket(struct ram_disk_dedup* dedup, u32 hash) {
+  return &dedup->buckets[hash_32(hash, dedup->bucket_bits)];
+}
+
+// Remove the entry for an index, if it has one. The table must be locked.
+static void forget_index(struct ram_disk_dedup* dedup, pgoff_t index) {
+  struct ram_disk_dedup_entry* entry = __xa_erase(&dedup->entries, index);
+  if (entry) {
+    hlist_del(&entry->node);
+    kfree(entry);
+  }
+}
+
+// Record that the page at index now has the given hash. If another index
+// already has it, its index is returned in match for the caller to try
+// merging with, and nothing is recorded; otherwise index becomes the
+// representative of the hash.
+bool ram_disk_dedup_find(struct ram_disk_store* store,
+                         u32 hash,
+                         pgoff_t index,
+                         pgoff_t* match) {
+  struct ram_disk_dedup* dedup = store->dedup;
+  struct ram_disk_dedup_entry* entry;
+  struct ram_disk_dedup_entry* new_entry =
+      kmalloc(sizeof(struct ram_disk_dedup_entry), GFP_NOIO);
+  bool found = false;
+
+  xa_lock(&dedup->entries);
+  forget_index(dedup, index);
+  hlist_for_each_entry(entry, bucket(dedup, hash), node) {
+    if (entry->hash == hash) {
+      *match = entry->index;
+      found = true;
+      break;
+    }
+  }
+  if (!found && new_entry) {
+    new_entry->hash = hash;
+    new_entry->index = index;
+    if (xa_is_err(__xa_store(&dedup->entries, index, new_entry,
+                             GFP_NOWAIT))) {
+      // Without an entry this page simply can't be matched.
+      kfree(new_entry);
+    } else {
+      hlist_add_head(&new_entry->node, bucket(dedup, hash));
+      new_entry = NULL;
+    }
+  }
+  xa_unlock(&dedup->entries);
+  kfree(new_entry);
+  return found;
+}
+
+// Called when the page at a matched index turned out to have different
+// contents, usually because the entry was stale. The caller's index takes
+// over the entry, since its contents are known to match the hash.
+void ram_disk_dedup_mismatch(struct ram_disk_store* store,
+                             u32 hash,
+                             pgoff_t stale,
+                             pgoff_t index) {
+  struct ram_disk_dedup* dedup = store->dedup;
+  struct ram_disk_dedup_entry* entry;
+  atomic64_inc(&dedup->mismatches);
+  xa_lock(&dedup->entries);
+  entry = xa_load(&dedup->entries, stale);
+  if (entry && entry->hash == hash && !xa_load(&dedup->entries, index) &&
+      !xa_is_err(__xa_store(&dedup->entries, index, entry, GFP_NOWAIT))) {
+    __xa_erase(&dedup->entries, stale);
+    entry->index = index;
+  }
+  xa_unlock(&dedup->entries);
+}
+
+void ram_disk_dedup_merged(struct ram_disk_store* store) {
+  atomic64_inc(&store->dedup->merged_pages);
+}
+
+void ram_disk_dedup_get_stats(struct ram_disk_store* store,
+                              struct ram_disk_dedup_stats* stats) {
+  struct ram_disk_dedup* dedup = store->dedup;
+  struct page* page;
+  unsigned long index;
+
+  stats->stored_pages = 0;
+  stats->mem_used = 0;
+  // A page's references are roughly the indices sharing it (mappings and
+  // snapshots add a few more), so each index is charged its share.
+  xa_for_each(&store->pages, index, page) {
+    stats->stored_pages++;
+    stats->mem_used += PAGE_SIZE / max(page_ref_count(page), 1);
+  }
+  stats->hashed_pages = atomic64_read(&dedup->hashed_pages);
+  stats->hash_ns = atomic64_read(&dedup->hash_ns);
+  stats->merged_pages = atomic64_read(&dedup->merged_pages);
+  stats->mismatches = atomic64_read(&dedup->mismatches);
+}
@@ -0,0 +1,20 @@
+#ifndef __RAM_DISK_IOCTL_H__
+#define __RAM_DISK_IOCTL_H__
+
+#include <linux/ioctl.h>
+
+// ioctls understood by /dev/ramdiskN. This header is shared with
+// userspace.
+
+#define RAM_DISK_IOC_MAGIC 0xDB
+
+// Create a copy-on-write snapshot of the disk. The snapshot shares every
+// page with the original until one of them writes to it. Returns the
+// number N of the new disk, /dev/ramdiskN.
+#define RAM_DISK_IOC_SNAPSHOT _IO(RAM_DISK_IOC_MAGIC, 1)
+
+// Destroy the snapshot with the number passed as the argument. Fails with
+// EBUSY if the snapshot is open.
+#define RAM_DISK_IOC_DELETE _IO(RAM_DISK_IOC_MAGIC, 2)
+
+#endif
@@ -0,0 +1,822 @@
+#include <asm-generic/errno-base.h>
+#include <linux/blk-mq.h>
+#include <linux/blkdev.h>
+#include <linux/capability.h>
+#include <linux/genhd.h>
+#include <linux/hrtimer.h>
+#include <linux/idr.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/llist.h>
+#include <linux/module.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include "ram_disk.h"
+#include "ram_disk_ioctl.h"
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Alex Nichol");
+MODULE_DESCRIPTION("A simple in-memory block device.");
+MODULE_VERSION("0.01");
+
+static unsigned int nr_disks = 1;
+module_param(nr_disks, uint, 0444);
+MODULE_PARM_DESC(nr_disks, "Number of disks to create at load time");
+
+static unsigned long size_mb = 1;
+module_param(size_mb, ulong, 0444);
+MODULE_PARM_DESC(size_mb, "Disk size in MiB (memory is allocated on write)");
+
+static unsigned int logical_block_size = 512;
+module_param(logical_block_size, uint, 0444);
+MODULE_PARM_DESC(logical_block_size, "Logical block size in bytes");
+
+static unsigned int physical_block_size = 512;
+module_param(physical_block_size, uint, 0444);
+MODULE_PARM_DESC(physical_block_size, "Physical block size in bytes");
+
+static unsigned int hw_queues;
+module_param(hw_queues, uint, 0444);
+MODULE_PARM_DESC(hw_queues, "Number of hardware queues (0 means one per CPU)");
+
+static unsigned int queue_depth = 128;
+module_param(queue_depth, uint, 0444);
+MODULE_PARM_DESC(queue_depth, "Number of tags per hardware queue");
+
+static unsigned int poll_queues;
+module_param(poll_queues, uint, 0444);
+MODULE_PARM_DESC(poll_queues, "Number of hardware queues for polled I/O");
+
+static unsigned int max_part;
+module_param(max_part, uint, 0444);
+MODULE_PARM_DESC(max_part, "Maximum number of partitions per disk");
+
+static bool bio_mode;
+module_param(bio_mode, bool, 0444);
+MODULE_PARM_DESC(bio_mode, "Handle bios directly instead of using blk-mq");
+
+
+static bool huge_pages;
+module_param(huge_pages, bool, 0444);
+MODULE_PARM_DESC(huge_pages, "Allocate memory in 2 MiB chunks when possible");
+
+static bool dedup;
+module_param(dedup, bool, 0444);
+MODULE_PARM_DESC(dedup, "Store pages with identical contents only once");
+
+static char compressor[CRYPTO_MAX_ALG_NAME];
+module_param_string(compressor, compressor, sizeof(compressor), 0444);
+MODULE_PARM_DESC(compressor, "Compress stored pages with lz4, zstd, etc.");
+
+static char numa_policy[16] = "local";
+module_param_string(numa_policy, numa_policy, sizeof(numa_policy), 0444);
+MODULE_PARM_DESC(numa_policy, "Memory placement: local, interleave or bind");
+
+static int numa_node;
+module_param(numa_node, int, 0444);
+MODULE_PARM_DESC(numa_node, "Node to allocate from with numa_policy=bind");
+
+static unsigned int numa_stripe_kb = 2048;
+module_param(numa_stripe_kb, uint, 0444);
+MODULE_PARM_DESC(numa_stripe_kb, "Stripe size for numa_policy=interleave");
+
+static char backing_file[256];
+module_param_string(backing_file, backing_file, sizeof(backing_file), 0444);
+MODULE_PARM_DESC(backing_file, "File to load the disk from and save it to");
+
+static unsigned int writeback_ms = 1000;
+module_param(writeback_ms, uint, 0444);
+MODULE_PARM_DESC(writeback_ms, "Interval between writebacks to backing_file");
+
+static char profile[16];
+module_param_string(profile, profile, sizeof(profile), 0444);
+MODULE_PARM_DESC(profile, "Device to emulate: nvme-gen4 or sata-ssd");
+
+static unsigned int read_latency_us;
+module_param(read_latency_us, uint, 0444);
+MODULE_PARM_DESC(read_latency_us, "Latency added to every read");
+
+static unsigned int write_latency_us;
+module_param(write_latency_us, uint, 0444);
+MODULE_PARM_DESC(write_latency_us, "Latency added to every write");
+
+static unsigned int read_mbps;
+module_param(read_mbps, uint, 0444);
+MODULE_PARM_DESC(read_mbps, "Read bandwidth ceiling in MB/s");
+
+static unsigned int write_mbps;
+module_param(write_mbps, uint, 0444);
+MODULE_PARM_DESC(write_mbps, "Write bandwidth ceiling in MB/s");
+
+struct ram_disk_info {
+  int major;
+  struct ida disk_ids;
+
+  // Disks created at load time and snapshots. Disks created through
+  // configfs are owned by their config items instead.
+  struct mutex disks_lock;
+  struct list_head disks;
+
+  // Serializes opening a disk with deciding to destroy it.
+  struct mutex open_lock;
+};
+
+static blk_status_t ram_disk_queue_rq(struct blk_mq_hw_ctx* hctx,
+                                      const struct blk_mq_queue_data* bd);
+static blk_qc_t ram_disk_submit_bio(struct bio* bio);
+static blk_status_t ram_disk_page_op(struct ram_disk* dev,
+                                     struct bio_vec* bvec,
+                                     sector_t sector,
+                                     bool is_write);
+static int ram_disk_open(struct block_device* bdev, fmode_t mode);
+static void ram_disk_release(struct gendisk* disk, fmode_t mode);
+static void ram_disk_destroy_work(struct work_struct* work);
+static int ram_disk_ioctl(struct block_device* bdev,
+                          fmode_t mode,
+                          unsigned int cmd,
+                          unsigned long arg);
+
+static int ram_disk_map_queues(struct blk_mq_tag_set* set);
+static int ram_disk_poll(struct blk_mq_hw_ctx* hctx);
+static int ram_disk_init_request(struct blk_mq_tag_set* set,
+                                 struct request* req,
+                                 unsigned int hctx_idx,
+                                 unsigned int numa_node);
+static enum hrtimer_restart ram_disk_timer_fn(struct hrtimer* timer);
+
+// Per-request data for requests that are not completed by
+// ram_disk_queue_rq() itself: those on poll queues, which are completed by
+// ram_disk_poll(), and those held back by a throttle, which are completed
+// by their timer.
+struct ram_disk_cmd {
+  struct llist_node node;
+  struct hrtimer timer;
+  blk_status_t status;
+  unsigned int segments;
+  u64 start;
+};
+
+static struct ram_disk_info info;
+static struct blk_mq_ops ram_disk_mq_ops = {
+    .queue_rq = ram_disk_queue_rq,
+    .map_queues = ram_disk_map_queues,
+    .poll = ram_disk_poll,
+    .init_request = ram_disk_init_request,
+};
+static struct block_device_operations ram_disk_ops = {
+    .open = ram_disk_open,
+    .release = ram_disk_release,
+    .ioctl = ram_disk_ioctl,
+    .owner = THIS_MODULE,
+};
+static struct block_device_operations ram_disk_bio_ops = {
+    .submit_bio = ram_disk_submit_bio,
+    .open = ram_disk_open,
+    .release = ram_disk_release,
+    .ioctl = ram_disk_ioctl,
+    .owner = THIS_MODULE,
+};
+
+// I/O paths
+
+// Each hardware context gets its own tags and is only ever run from the
+// CPUs mapped to it, so nothing on this path touches shared state other
+// than the backing memory itself. Overlapping I/O is not ordered by the
+// block layer, so there is nothing for a lock to protect.
+static blk_status_t ram_disk_queue_rq(struct blk_mq_hw_ctx* hctx,
+                                      const struct blk_mq_queue_data* bd) {
+  struct ram_disk* dev = hctx->queue->queuedata;
+  struct request* req = bd->rq;
+  u64 start = ktime_get_ns();
+  unsigned int segments = 0;
+  blk_status_t status = BLK_STS_OK;
+  struct bio_vec bvec;
+  struct req_iterator iter;
+
+  blk_mq_start_request(req);
+  switch (req_op(req)) {
+    case REQ_OP_READ:
+    case REQ_OP_WRITE:
+      rq_for_each_segment(bvec, req, iter) {
+        status = ram_disk_page_op(dev, &bvec, iter.iter.bi_sector,
+                                  rq_data_dir(req) == WRITE);
+        if (status) {
+          break;
+        }
+        segments++;
+      }
+      break;
+    case REQ_OP_DISCARD:
+    case REQ_OP_WRITE_ZEROES:
+      status = ram_disk_store_discard(&dev->store, blk_rq_pos(req),
+                                      blk_rq_bytes(req));
+      break;
+    case REQ_OP_FLUSH:
+      break;
+    default:
+      status = BLK_STS_NOTSUPP;
+  }
+  if (dev->backing && op_is_write(req_op(req)) && !status) {
+    ram_disk_backing_mark_dirty(dev, blk_rq_pos(req), blk_rq_bytes(req));
+  }
+  if (dev->throttle.enabled) {
+    struct ram_disk_cmd* cmd = blk_mq_rq_to_pdu(req);
+    bool is_data = req_op(req) == REQ_OP_READ || req_op(req) == REQ_OP_WRITE;
+    u64 deadline = ram_disk_throttle_deadline(
+        &dev->throttle, op_is_write(req_op(req)),
+        is_data ? blk_rq_bytes(req) : 0, start);
+    cmd->status = status;
+    cmd->segments = segments;
+    cmd->start = start;
+    hrtimer_start(&cmd->timer, ns_to_ktime(deadline), HRTIMER_MODE_ABS);
+    return BLK_STS_OK;
+  }
+  ram_disk_stats_account(dev, req_op(req), blk_rq_bytes(req), segments,
+                         start);
+  if (hctx->type == HCTX_TYPE_POLL) {
+    // The submitter is spinning in ram_disk_poll() waiting for this, so
+    // let it reap the completion instead of waking it up.
+    struct ram_disk_cmd* cmd = blk_mq_rq_to_pdu(req);
+    cmd->status = status;
+    llist_add(&cmd->node, &dev->poll_lists[hctx->queue_num]);
+    return BLK_STS_OK;
+  }
+  blk_mq_end_request(req, status);
+  return BLK_STS_OK;
+}
+
+static int ram_disk_init_request(struct blk_mq_tag_set* set,
+                                 struct request* req,
+                                 unsigned int hctx_idx,
+                                 unsigned int numa_node) {
+  struct ram_disk_cmd* cmd = blk_mq_rq_to_pdu(req);
+  hrtimer_init(&cmd->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+  cmd->timer.function = ram_disk_timer_fn;
+  return 0;
+}
+
+// Completes a request held back by the throttle. Its latency is counted
+// up to now, so the stats show what the emulated device looks like.
+static enum hrtimer_restart ram_disk_timer_fn(struct hrtimer* timer) {
+  struct ram_disk_cmd* cmd = container_of(timer, struct ram_disk_cmd, timer);
+  struct request* req = blk_mq_rq_from_pdu(cmd);
+  ram_disk_stats_account(req->q->queuedata, req_op(req), blk_rq_bytes(req),
+                         cmd->segments, cmd->start);
+  blk_mq_end_request(req, cmd->status);
+  return HRTIMER_NORESTART;
+}
+
+static int ram_disk_map_queues(struct blk_mq_tag_set* set) {
+  struct ram_disk* dev = set->driver_data;
+  struct blk_mq_queue_map* map;
+  unsigned int offset = 0;
+  int i;
+  for (i = 0; i < set->nr_maps; i++) {
+    map = &set->map[i];
+    switch (i) {
+      case HCTX_TYPE_DEFAULT:
+        map->nr_queues = set->nr_hw_queues - dev->config.poll_queues;
+        break;
+      case HCTX_TYPE_READ:
+        // Reads share the default queues.
+        map->nr_queues = 0;
+        continue;
+      case HCTX_TYPE_POLL:
+        map->nr_queues = dev->config.poll_queues;
+        break;
+    }
+    map->queue_offset = offset;
+    offset += map->nr_queues;
+    blk_mq_map_queues(map);
+  }
+  return 0;
+}
+
+// Completes every request that has finished on a poll queue.
+static int ram_disk_poll(struct blk_mq_hw_ctx* hctx) {
+  struct ram_disk* dev = hctx->queue->queuedata;
+  struct llist_node* list = llist_del_all(&dev->poll_lists[hctx->queue_num]);
+  struct ram_disk_cmd* cmd;
+  struct ram_disk_cmd* tmp;
+  int found = 0;
+  // Complete in submission order.
+  list = llist_reverse_order(list);
+  llist_for_each_entry_safe(cmd, tmp, list, node) {
+    blk_mq_end_request(blk_mq_rq_from_pdu(cmd), cmd->status);
+    found++;
+  }
+  return found;
+}
+
+// In bio mode there is no request allocation, tag, or completion
+// softirq: every bio is copied and completed in the submitter's context.
+static blk_qc_t ram_disk_submit_bio(struct bio* bio) {
+  struct ram_disk* dev = bio->bi_disk->private_data;
+  u64 start = ktime_get_ns();
+  unsigned int segments = 0;
+  blk_status_t status = BLK_STS_OK;
+  struct bio_vec bvec;
+  struct bvec_iter iter;
+
+  switch (bio_op(bio)) {
+    case REQ_OP_READ:
+    case REQ_OP_WRITE:
+      bio_for_each_segment(bvec, bio, iter) {
+        status = ram_disk_page_op(dev, &bvec, iter.bi_sector,
+                                  op_is_write(bio_op(bio)));
+        if (status) {
+          break;
+        }
+        segments++;
+      }
+      break;
+    case REQ_OP_DISCARD:
+    case REQ_OP_WRITE_ZEROES:
+      status = ram_disk_store_discard(&dev->store, bio->bi_iter.bi_sector,
+                                      bio->bi_iter.bi_size);
+      break;
+    case REQ_OP_FLUSH:
+      break;
+    default:
+      status = BLK_STS_NOTSUPP;
+  }
+  if (dev->backing && op_is_write(bio_op(bio)) && !status) {
+    ram_disk_backing_mark_dirty(dev, bio->bi_iter.bi_sector,
+                                bio->bi_iter.bi_size);
+  }
+  ram_disk_stats_account(dev, bio_op(bio), bio->bi_iter.bi_size, segments,
+                         start);
+  bio->bi_status = status;
+  bio_endio(bio);
+  return BLK_QC_T_NONE;
+}
+
+static blk_status_t ram_disk_page_op(struct ram_disk* dev,
+                                     struct bio_vec* bvec,
+                                     sector_t sector,
+                                     bool is_write) {
+  if (is_write) {
+    return ram_disk_store_write(&dev->store, bvec->bv_page, bvec->bv_offset,
+                                bvec->bv_len, sector);
+  }
+  return ram_disk_store_read(&dev->store, bvec->bv_page, bvec->bv_offset,
+                             bvec->bv_len, sector);
+}
+
+// Block device operations
+
+static int ram_disk_open(struct block_device* bdev, fmode_t mode) {
+  struct ram_disk* dev;
+  int res = 0;
+  mutex_lock(&info.open_lock);
+  // Cleared once the disk is gone, for openers that found it before.
+  dev = bdev->bd_disk->private_data;
+  if (!dev || dev->dying) {
+    res = -ENXIO;
+  } else {
+    dev->open_count++;
+  }
+  mutex_unlock(&info.open_lock);
+  return res;
+}
+
+static void ram_disk_release(struct gendisk* disk, fmode_t mode) {
+  struct ram_disk* dev = disk->private_data;
+  bool destroy;
+  mutex_lock(&info.open_lock);
+  destroy = !--dev->open_count && dev->dying;
+  mutex_unlock(&info.open_lock);
+  if (destroy) {
+    // The disk can't be deleted from inside its own release.
+    schedule_work(&dev->destroy_work);
+  }
+}
+
+static int ram_disk_ioctl_snapshot(struct ram_disk* dev) {
+  struct ram_disk* snapshot = ram_disk_create_snapshot(dev);
+  if (IS_ERR(snapshot)) {
+    return PTR_ERR(snapshot);
+  }
+  mutex_lock(&info.disks_lock);
+  list_add_tail(&snapshot->link, &info.disks);
+  mutex_unlock(&info.disks_lock);
+  return snapshot->id;
+}
+
+static int ram_disk_ioctl_delete(int id) {
+  struct ram_disk* dev;
+  int res = -ENOENT;
+  mutex_lock(&info.disks_lock);
+  list_for_each_entry(dev, &info.disks, link) {
+    if (dev->id != id || !dev->is_snapshot) {
+      continue;
+    }
+    res = ram_disk_begin_destroy(dev);
+    if (!res) {
+      list_del(&dev->link);
+      ram_disk_destroy(dev);
+    }
+    break;
+  }
+  mutex_unlock(&info.disks_lock);
+  return res;
+}
+
+static int ram_disk_ioctl(struct block_device* bdev,
+                          fmode_t mode,
+                          unsigned int cmd,
+                          unsigned long arg) {
+  struct ram_disk* dev = bdev->bd_disk->private_data;
+  switch (cmd) {
+    case RAM_DISK_IOC_SNAPSHOT:
+      if (!capable(CAP_SYS_ADMIN)) {
+        return -EPERM;
+      }
+      if (bdev_is_partition(bdev)) {
+        return -EINVAL;
+      }
+      return ram_disk_ioctl_snapshot(dev);
+    case RAM_DISK_IOC_DELETE:
+      if (!capable(CAP_SYS_ADMIN)) {
+        return -EPERM;
+      }
+      return ram_disk_ioctl_delete((int)arg);
+    default:
+      return -ENOTTY;
+  }
+}
+
+// Disk lifecycle
+
+void ram_disk_default_config(struct ram_disk_config* config) {
+  config->size_mb = size_mb;
+  config->logical_block_size = logical_block_size;
+  config->physical_block_size = physical_block_size;
+  config->hw_queues = hw_queues;
+  config->queue_depth = queue_depth;
+  config->poll_queues = poll_queues;
+  config->max_part = max_part;
+  config->bio_mode = bio_mode;
+  config->huge_pages = huge_pages;
+  config->dedup = dedup;
+  strscpy(config->compressor, compressor, sizeof(config->compressor));
+  strscpy(config->numa_policy, numa_policy, sizeof(config->numa_policy));
+  config->numa_node = numa_node;
+  config->numa_stripe_kb = numa_stripe_kb;
+  strscpy(config->backing_file, backing_file, sizeof(config->backing_file));
+  config->writeback_ms = writeback_ms;
+  strscpy(config->profile, profile, sizeof(config->profile));
+  config->read_latency_us = read_latency_us;
+  config->write_latency_us = write_latency_us;
+  config->read_mbps = read_mbps;
+  config->write_mbps = write_mbps;
+}
+
+static int ram_disk_check_config(const struct ram_disk_config* config) {
+  unsigned int lbs = config->logical_block_size;
+  unsigned int pbs = config->physical_block_size;
+  if (!config->size_mb) {
+    return -EINVAL;
+  }
+  if (lbs < 512 || lbs > PAGE_SIZE || !is_power_of_2(lbs)) {
+    return -EINVAL;
+  }
+  if (pbs < lbs || pbs > PAGE_SIZE || !is_power_of_2(pbs)) {
+    return -EINVAL;
+  }
+  if (!config->bio_mode && !config->queue_depth) {
+    return -EINVAL;
+  }
+  if (config->max_part >= RAM_DISK_MINORS) {
+    return -EINVAL;
+  }
+  if (config->huge_pages && config->compressor[0]) {
+    // Compressed pages aren't stored in pages of their own.
+    return -EINVAL;
+  }
+  if (config->dedup && config->compressor[0]) {
+    // Compressed handles can't be shared.
+    return -EINVAL;
+  }
+  if (config->backing_file[0] && !config->writeback_ms) {
+    return -EINVAL;
+  }
+  return 0;
+}
+
+static int ram_disk_init_mq(struct ram_disk* dev) {
+  unsigned int hw_queues = dev->config.hw_queues;
+  unsigned int queue_depth = dev->config.queue_depth;
+  int res;
+  dev->tag_set.ops = &ram_disk_mq_ops;
+  if (dev->throttle.queue_depth) {
+    // Take the queue shape of the emulated device too.
+    hw_queues = dev->throttle.hw_queues;
+    queue_depth = dev->throttle.queue_depth;
+  }
+  dev->tag_set.nr_hw_queues = hw_queues ? hw_queues : nr_cpu_ids;
+  if (dev->config.poll_queues) {
+    // Poll queues come after the default ones and are only used for
+    // REQ_HIPRI I/O, such as io_uring with IORING_SETUP_IOPOLL.
+    dev->tag_set.nr_hw_queues += dev->config.poll_queues;
+    dev->tag_set.nr_maps = HCTX_MAX_TYPES;
+    dev->poll_lists = kcalloc(dev->tag_set.nr_hw_queues,
+                              sizeof(struct llist_head), GFP_KERNEL);
+    if (!dev->poll_lists) {
+      return -ENOMEM;
+    }
+  }
+  dev->tag_set.cmd_size = sizeof(struct ram_disk_cmd);
+  dev->tag_set.queue_depth = queue_depth;
+  // Keep the tags near the memory when it is all on one node.
+  dev->tag_set.numa_node = dev->store.numa.node;
+  // Writes to fresh pages allocate memory, which may sleep.
+  dev->tag_set.flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
+  dev->tag_set.driver_data = dev;
+  res = blk_mq_alloc_tag_set(&dev->tag_set);
+  if (res) {
+    kfree(dev->poll_lists);
+    return res;
+  }
+  dev->queue = blk_mq_init_queue(&dev->tag_set);
+  if (IS_ERR(dev->queue)) {
+    blk_mq_free_tag_set(&dev->tag_set);
+    kfree(dev->poll_lists);
+    return PTR_ERR(dev->queue);
+  }
+  return 0;
+}
+
+static void ram_disk_free_queue(struct ram_disk* dev) {
+  blk_cleanup_queue(dev->queue);
+  if (!dev->config.bio_mode) {
+    blk_mq_free_tag_set(&dev->tag_set);
+  }
+  kfree(dev->poll_lists);
+}
+
+// Create a disk, optionally starting out as a snapshot of origin.
+static struct ram_disk* create_disk(const struct ram_disk_config* config,
+                                    struct ram_disk* origin) {
+  struct ram_disk* dev;
+  int res = ram_disk_check_config(config);
+  if (res) {
+    return ERR_PTR(res);
+  }
+
+  dev = kzalloc(sizeof(struct ram_disk), GFP_KERNEL);
+  if (!dev) {
+    return ERR_PTR(-ENOMEM);
+  }
+  dev->config = *config;
+  dev->is_snapshot = origin != NULL;
+  INIT_WORK(&dev->destroy_work, ram_disk_destroy_work);
+  INIT_LIST_HEAD(&dev->link);
+  res = ram_disk_throttle_init(&dev->throttle, config);
+  if (res) {
+    kfree(dev);
+    return ERR_PTR(res);
+  }
+  res = ram_disk_stats_init(dev);
+  if (res) {
+    kfree(dev);
+    return ERR_PTR(res);
+  }
+  res = ram_disk_store_init(&dev->store, config);
+  if (res) {
+    ram_disk_stats_free(dev);
+    kfree(dev);
+    return ERR_PTR(res);
+  }
+
+  if (origin) {
+    // Stop I/O to the origin so that no page can be modified while it is
+    // becoming shared.
+    blk_mq_freeze_queue(origin->queue);
+    res = ram_disk_store_clone(&dev->store, &origin->store);
+    blk_mq_unfreeze_queue(origin->queue);
+    if (res) {
+      ram_disk_store_free(&dev->store);
+      ram_disk_stats_free(dev);
+      kfree(dev);
+      return ERR_PTR(res);
+    }
+  }
+
+  if (config->backing_file[0]) {
+    res = ram_disk_backing_init(dev);
+    if (res) {
+      ram_disk_store_free(&dev->store);
+      ram_disk_stats_free(dev);
+      kfree(dev);
+      return ERR_PTR(res);
+    }
+  }
+
+  dev->id = ida_simple_get(&info.disk_ids, 0,
+                          RAM_DISK_MAX_DISKS, GFP_KERNEL);
+  if (dev->id < 0) {
+    res = dev->id;
+    goto fail_store;
+  }
+
+  res = -ENOMEM;
+  if (config->bio_mode) {
+    dev->queue = blk_alloc_queue(NUMA_NO_NODE);
+    if (!dev->queue) {
+      goto fail_id;
+    }
+  } else {
+    res = ram_disk_init_mq(dev);
+    if (res) {
+      goto fail_id;
+    }
+  }
+  dev->queue->queuedata = dev;
+  blk_queue_logical_block_size(dev->queue, config->logical_block_size);
+  blk_queue_physical_block_size(dev->queue, config->physical_block_size);
+  dev->queue->limits.discard_granularity = PAGE_SIZE;
+  blk_queue_max_discard_sectors(dev->queue, UINT_MAX >> SECTOR_SHIFT);
+  blk_queue_max_write_zeroes_sectors(dev->queue, UINT_MAX >> SECTOR_SHIFT);
+  blk_queue_flag_set(QUEUE_FLAG_DISCARD, dev->queue);
+
+  res = -ENOMEM;
+  dev->disk = alloc_disk(config->max_part + 1);
+  if (!dev->disk) {
+    goto fail_queue;
+  }
+  dev->disk->major = info.major;
+  dev->disk->first_minor = dev->id * RAM_DISK_MINORS;
+  dev->disk->fops = config->bio_mode ? &ram_disk_bio_ops : &ram_disk_ops;
+  dev->disk->private_data = dev;
+  dev->disk->queue = dev->queue;
+  if (!config->max_part) {
+    dev->disk->flags |= GENHD_FL_NO_PART_SCAN;
+  }
+  snprintf(dev->disk->disk_name, DISK_NAME_LEN, "ramdisk%d", dev->id);
+  set_capacity(dev->disk, dev->store.size >> SECTOR_SHIFT);
+  device_add_disk(NULL, dev->disk, ram_disk_attr_groups);
+  ram_disk_stats_register(dev);
+  res = ram_disk_mem_init(dev);
+  if (res) {
+    goto fail_add;
+  }
+
+  return dev;
+
+fail_add:
+  del_gendisk(dev->disk);
+  put_disk(dev->disk);
+fail_queue:
+  ram_disk_free_queue(dev);
+fail_id:
+  ida_simple_remove(&info.disk_ids, dev->id);
+fail_store:
+  ram_disk_backing_free(dev);
+  ram_disk_store_free(&dev->store);
+  ram_disk_stats_free(dev);
+  kfree(dev);
+  return ERR_PTR(res);
+}
+
+struct ram_disk* ram_disk_create(const struct ram_disk_config* config) {
+  return create_disk(config, NULL);
+}
+
+struct ram_disk* ram_disk_create_snapshot(struct ram_disk* origin) {
+  struct ram_disk_config config = origin->config;
+  if (origin->store.comp) {
+    // Compressed handles can't be shared.
+    return ERR_PTR(-EOPNOTSUPP);
+  }
+  // The snapshot lives in memory only; the file belongs to the origin.
+  config.backing_file[0] = 0;
+  return create_disk(&config, origin);
+}
+
+// Fail with -EBUSY if the disk is open, or otherwise make sure it never
+// will be again so the caller can destroy it. Checking and marking the disk
+// under the open lock keeps an open from sneaking in between.
+int ram_disk_begin_destroy(struct ram_disk* dev) {
+  int res = 0;
+  mutex_lock(&info.open_lock);
+  if (dev->open_count) {
+    res = -EBUSY;
+  } else {
+    dev->dying = true;
+  }
+  mutex_unlock(&info.open_lock);
+  return res;
+}
+
+void ram_disk_destroy(struct ram_disk* dev) {
+  del_gendisk(dev->disk);
+  mutex_lock(&info.open_lock);
+  dev->disk->private_data = NULL;
+  mutex_unlock(&info.open_lock);
+  put_disk(dev->disk);
+  ram_disk_free_queue(dev);
+  ram_disk_mem_free(dev);
+  ram_disk_backing_free(dev);
+  ram_disk_store_free(&dev->store);
+  ram_disk_stats_free(dev);
+  ida_simple_remove(&info.disk_ids, dev->id);
+  kfree(dev);
+}
+
+static void ram_disk_destroy_work(struct work_struct* work) {
+  ram_disk_destroy(container_of(work, struct ram_disk, destroy_work));
+}
+
+// Destroy a disk that can't be kept around, such as one whose configfs
+// item was removed: right away if it isn't open, or else once it's closed.
+void ram_disk_remove(struct ram_disk* dev) {
+  bool busy;
+  mutex_lock(&info.open_lock);
+  busy = dev->open_count;
+  dev->dying = true;
+  mutex_unlock(&info.open_lock);
+  if (!busy) {
+    ram_disk_destroy(dev);
+  }
+}
+
+// Module lifecycle
+
+static void ram_disk_destroy_all(void) {
+  struct ram_disk* dev;
+  struct ram_disk* tmp;
+  // Snapshots go first, which leaves less sharing for the origins to
+  // undo.
+  list_for_each_entry_safe_reverse(dev, tmp, &info.disks, link) {
+    list_del(&dev->link);
+    ram_disk_destroy(dev);
+  }
+}
+
+static int __init ram_disk_init(void) {
+  struct ram_disk_config config;
+  unsigned int i;
+  int res;
+
+  printk(KERN_INFO "Loading RAMDisk module\n");
+  ida_init(&info.disk_ids);
+  mutex_init(&info.disks_lock);
+  INIT_LIST_HEAD(&info.disks);
+  mutex_init(&info.open_lock);
+
+  info.major = register_blkdev(0, DRIVER_NAME);
+  if (info.major <= 0) {
+    return info.major ? info.major : -EBUSY;
+  }
+  ram_disk_stats_module_init();
+  res = ram_disk_mem_module_init();
+  if (res) {
+    goto fail_mem;
+  }
+
+  ram_disk_default_config(&config);
+  for (i = 0; i < nr_disks; ++i) {
+    struct ram_disk* dev = ram_disk_create(&config);
+    if (IS_ERR(dev)) {
+      res = PTR_ERR(dev);
+      goto fail_disks;
+    }
+    list_add_tail(&dev->link, &info.disks);
+  }
+
+  res = ram_disk_configfs_init();
+  if (res) {
+    goto fail_disks;
+  }
+
+  return 0;
+
+fail_disks:
+  ram_disk_destroy_all();
+  ram_disk_mem_module_exit();
+fail_mem:
+  ram_disk_stats_module_exit();
+  unregister_blkdev(info.major, DRIVER_NAME);
+  ida_destroy(&info.disk_ids);
+  return res;
+}
+
+static void __exit ram_disk_exit(void) {
+  printk(KERN_INFO "Unloading RAMDisk module\n");
+  ram_disk_configfs_exit();
+  // Removed configfs disks may have been closed just before the module.
+  flush_scheduled_work();
+  ram_disk_destroy_all();
+  ram_disk_mem_module_exit();
+  ram_disk_stats_module_exit();
+  unregister_blkdev(info.major, DRIVER_NAME);
+  ida_destroy(&info.disk_ids);
+
+  // Discarded pages are freed from RCU callbacks.
+  rcu_barrier();
+}
+
+module_init(ram_disk_init);
+module_exit(ram_disk_exit);
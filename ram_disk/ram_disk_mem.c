@@ -0,0 +1,230 @@
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/mm.h>
+#include <linux/rwsem.h>
+#include <linux/slab.h>
+#include <linux/xarray.h>
+#include "ram_disk.h"
+
+// Every disk gets a character device, /dev/ramdiskN_mem, that can be
+// mmapped to look at the store's pages directly instead of reading them
+// through the block layer. Mappings are read-only: writing through them
+// would skip copy-on-write, the backing file's dirty bitmap, and so on.
+//
+// Pages are mapped one at a time as they are faulted in, with holes in
+// the store mapped to a zeroed page of the device's own. Whenever the
+// store inserts, replaces, or removes a page, it unmaps that range (see
+// invalidate() in ram_disk_store.c) so the next access faults in the new
+// page. Faults hand pages to the mm locked, and the store locks the page
+// it replaced around unmapping it, so a fault can't install a mapping of
+// a page the store already let go of.
+//
+// Mapping a page takes a reference to it, and writes check for other
+// references with the page locked, so a write to a mapped page copies it
+// first, just like a page shared with a snapshot; a reader never sees a
+// page change underneath it.
+//
+// Open files can outlive the disk, so the state they use is refcounted,
+// and faults after the disk is gone raise SIGBUS.
+
+struct ram_disk_mem {
+  struct kref ref;
+
+  // Protects dev, which is cleared when the disk is destroyed.
+  struct rw_semaphore lock;
+  struct ram_disk* dev;
+
+  // All mappings of the device go through this, so they can be found and
+  // unmapped regardless of which device node they were opened from.
+  struct address_space mapping;
+  // Mapped in place of holes. Unlike the shared zero page, it can be
+  // locked like the store's pages.
+  struct page* hole_page;
+
+  struct cdev* cdev;
+  struct device* device;
+};
+
+static dev_t mem_devt;
+static struct class* mem_class;
+
+// Disks by id, for opening their devices.
+static DEFINE_XARRAY(mem_devs);
+
+static void mem_release(struct kref* ref) {
+  struct ram_disk_mem* mem = container_of(ref, struct ram_disk_mem, ref);
+  put_page(mem->hole_page);
+  kfree(mem);
+}
+
+static vm_fault_t mem_fault(struct vm_fault* vmf) {
+  struct ram_disk_mem* mem = vmf->vma->vm_file->private_data;
+  vm_fault_t res = VM_FAULT_LOCKED;
+
+  down_read(&mem->lock);
+  if (!mem->dev ||
+      vmf->pgoff >= DIV_ROUND_UP(mem->dev->store.size, PAGE_SIZE)) {
+    res = VM_FAULT_SIGBUS;
+  } else {
+    vmf->page = ram_disk_store_map_page(&mem->dev->store, vmf->pgoff);
+  }
+  up_read(&mem->lock);
+  return res;
+}
+
+static const struct vm_operations_struct mem_vm_ops = {
+    .fault = mem_fault,
+};
+
+static int mem_open(struct inode* inode, struct file* filp) {
+  struct ram_disk_mem* mem;
+  xa_lock(&mem_devs);
+  mem = xa_load(&mem_devs, iminor(inode));
+  if (mem) {
+    kref_get(&mem->ref);
+  }
+  xa_unlock(&mem_devs);
+  if (!mem) {
+    return -ENODEV;
+  }
+  filp->private_data = mem;
+  filp->f_mapping = &mem->mapping;
+  return 0;
+}
+
+static int mem_release_file(struct inode* inode, struct file* filp) {
+  struct ram_disk_mem* mem = filp->private_data;
+  kref_put(&mem->ref, mem_release);
+  return 0;
+}
+
+static int mem_mmap(struct file* filp, struct vm_area_struct* vma) {
+  struct ram_disk_mem* mem = filp->private_data;
+  int res = 0;
+  if (vma->vm_flags & VM_WRITE) {
+    return -EPERM;
+  }
+  down_read(&mem->lock);
+  if (!mem->dev) {
+    res = -ENODEV;
+  } else if (mem->dev->store.comp) {
+    // Compressed pages have nothing to map.
+    res = -EOPNOTSUPP;
+  }
+  up_read(&mem->lock);
+  if (res) {
+    return res;
+  }
+  vma->vm_flags &= ~VM_MAYWRITE;
+  vma->vm_flags |= VM_DONTEXPAND;
+  vma->vm_ops = &mem_vm_ops;
+  return 0;
+}
+
+static const struct file_operations mem_fops = {
+    .owner = THIS_MODULE,
+    .open = mem_open,
+    .release = mem_release_file,
+    .mmap = mem_mmap,
+};
+
+int ram_disk_mem_init(struct ram_disk* dev) {
+  struct ram_disk_mem* mem;
+  dev_t devt = MKDEV(MAJOR(mem_devt), dev->id);
+  int res;
+
+  mem = kzalloc(sizeof(struct ram_disk_mem), GFP_KERNEL);
+  if (!mem) {
+    return -ENOMEM;
+  }
+  kref_init(&mem->ref);
+  init_rwsem(&mem->lock);
+  mem->dev = dev;
+  address_space_init_once(&mem->mapping);
+  mem->hole_page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+  if (!mem->hole_page) {
+    kfree(mem);
+    return -ENOMEM;
+  }
+
+  res = xa_insert(&mem_devs, dev->id, mem, GFP_KERNEL);
+  if (res) {
+    goto fail_free;
+  }
+
+  res = -ENOMEM;
+  mem->cdev = cdev_alloc();
+  if (!mem->cdev) {
+    goto fail_erase;
+  }
+  mem->cdev->owner = THIS_MODULE;
+  mem->cdev->ops = &mem_fops;
+  res = cdev_add(mem->cdev, devt, 1);
+  if (res) {
+    kobject_put(&mem->cdev->kobj);
+    goto fail_erase;
+  }
+
+  mem->device = device_create(mem_class, NULL, devt, NULL, "%s_mem",
+                              dev->disk->disk_name);
+  if (IS_ERR(mem->device)) {
+    res = PTR_ERR(mem->device);
+    goto fail_cdev;
+  }
+
+  dev->mem = mem;
+  dev->store.hole_page = mem->hole_page;
+  dev->store.mapping = &mem->mapping;
+  return 0;
+
+fail_cdev:
+  cdev_del(mem->cdev);
+fail_erase:
+  xa_erase(&mem_devs, dev->id);
+fail_free:
+  put_page(mem->hole_page);
+  kfree(mem);
+  return res;
+}
+
+void ram_disk_mem_free(struct ram_disk* dev) {
+  struct ram_disk_mem* mem = dev->mem;
+  if (!mem) {
+    return;
+  }
+  xa_erase(&mem_devs, dev->id);
+  device_destroy(mem_class, MKDEV(MAJOR(mem_devt), dev->id));
+  cdev_del(mem->cdev);
+
+  // Drop every mapped page, and make sure none can be faulted in again.
+  down_write(&mem->lock);
+  dev->store.mapping = NULL;
+  mem->dev = NULL;
+  up_write(&mem->lock);
+  unmap_mapping_range(&mem->mapping, 0, 0, 1);
+
+  dev->mem = NULL;
+  kref_put(&mem->ref, mem_release);
+}
+
+int ram_disk_mem_module_init(void) {
+  int res = alloc_chrdev_region(&mem_devt, 0, RAM_DISK_MAX_DISKS,
+                                DRIVER_NAME "_mem");
+  if (res) {
+    return res;
+  }
+  mem_class = class_create(THIS_MODULE, DRIVER_NAME "_mem");
+  if (IS_ERR(mem_class)) {
+    unregister_chrdev_region(mem_devt, RAM_DISK_MAX_DISKS);
+    return PTR_ERR(mem_class);
+  }
+  return 0;
+}
+
+void ram_disk_mem_module_exit(void) {
+  class_destroy(mem_class);
+  unregister_chrdev_region(mem_devt, RAM_DISK_MAX_DISKS);
+}
@@ -0,0 +1,114 @@
+#include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/nodemask.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/topology.h>
+#include "ram_disk.h"
+
+// Placement of store memory across NUMA nodes:
+//
+//  * "local" allocates each page on the node of the CPU that first writes
+//    it, which is what the page allocator does by default.
+//  * "interleave" spreads fixed-size stripes of the disk round-robin over
+//    all online nodes, so no single node's memory bandwidth is the limit.
+//  * "bind" allocates everything on one node and fails writes rather than
+//    fall back to another node.
+//
+// Every access to a stored page is counted as a hit if the page is on the
+// accessing CPU's node and a miss otherwise. Counters are per CPU and are
+// only grouped by node when shown.
+
+static const char* policy_names[] = {
+    [RAM_DISK_NUMA_LOCAL] = "local",
+    [RAM_DISK_NUMA_INTERLEAVE] = "interleave",
+    [RAM_DISK_NUMA_BIND] = "bind",
+};
+
+int ram_disk_numa_init(struct ram_disk_numa* numa,
+                       const struct ram_disk_config* config,
+                       gfp_t* gfp) {
+  int policy = sysfs_match_string(policy_names, config->numa_policy);
+  int node;
+  int i;
+
+  if (policy < 0) {
+    return -EINVAL;
+  }
+  numa->policy = policy;
+  numa->node = NUMA_NO_NODE;
+  numa->nodes = NULL;
+
+  if (policy == RAM_DISK_NUMA_BIND) {
+    if (config->numa_node < 0 || config->numa_node >= nr_node_ids ||
+        !node_online(config->numa_node)) {
+      return -EINVAL;
+    }
+    numa->node = config->numa_node;
+    *gfp |= __GFP_THISNODE;
+  } else if (policy == RAM_DISK_NUMA_INTERLEAVE) {
+    unsigned long stripe_pages = config->numa_stripe_kb >> (PAGE_SHIFT - 10);
+    if (!stripe_pages || !is_power_of_2(stripe_pages)) {
+      return -EINVAL;
+    }
+    numa->stripe_shift = ilog2(stripe_pages);
+    numa->nr_nodes = num_online_nodes();
+    numa->nodes = kcalloc(numa->nr_nodes, sizeof(int), GFP_KERNEL);
+    if (!numa->nodes) {
+      return -ENOMEM;
+    }
+    i = 0;
+    for_each_online_node(node) {
+      if (i < numa->nr_nodes) {
+        numa->nodes[i++] = node;
+      }
+    }
+    numa->nr_nodes = i;
+  }
+
+  numa->stats = alloc_percpu(struct ram_disk_numa_cpu_stats);
+  if (!numa->stats) {
+    kfree(numa->nodes);
+    numa->nodes = NULL;
+    return -ENOMEM;
+  }
+  return 0;
+}
+
+void ram_disk_numa_free(struct ram_disk_numa* numa) {
+  free_percpu(numa->stats);
+  numa->stats = NULL;
+  kfree(numa->nodes);
+  numa->nodes = NULL;
+}
+
+int ram_disk_numa_node(struct ram_disk_numa* numa, pgoff_t index) {
+  switch (numa->policy) {
+    case RAM_DISK_NUMA_INTERLEAVE:
+      return numa->nodes[(index >> numa->stripe_shift) % numa->nr_nodes];
+    case RAM_DISK_NUMA_BIND:
+      return numa->node;
+    default:
+      return NUMA_NO_NODE;
+  }
+}
+
+void ram_disk_numa_show(struct seq_file* s, struct ram_disk_numa* numa) {
+  int node;
+  int cpu;
+  seq_printf(s, "numa_policy %s\n", policy_names[numa->policy]);
+  for_each_online_node(node) {
+    u64 hit = 0;
+    u64 miss = 0;
+    for_each_possible_cpu(cpu) {
+      if (cpu_to_node(cpu) == node) {
+        struct ram_disk_numa_cpu_stats* stats = per_cpu_ptr(numa->stats, cpu);
+        hit += stats->hit;
+        miss += stats->miss;
+      }
+    }
+    seq_printf(s, "node%d hit %llu miss %llu\n", node, hit, miss);
+  }
+}
@@ -0,0 +1,50 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include "ram_disk_ioctl.h"
+
+// Create or delete ram_disk snapshots.
+//
+//   ram_disk_snap /dev/ramdisk0        # prints the new snapshot's number
+//   ram_disk_snap -d /dev/ramdisk0 N   # deletes /dev/ramdiskN
+
+static void usage(const char* name) {
+  fprintf(stderr, "Usage: %s <device>\n", name);
+  fprintf(stderr, "       %s -d <device> <snapshot number>\n", name);
+  exit(1);
+}
+
+int main(int argc, const char** argv) {
+  int delete = argc == 4 && !strcmp(argv[1], "-d");
+  const char* path;
+  int fd;
+  int res;
+
+  if (argc != 2 && !delete) {
+    usage(argv[0]);
+  }
+  path = delete ? argv[2] : argv[1];
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return 1;
+  }
+  if (delete) {
+    res = ioctl(fd, RAM_DISK_IOC_DELETE, atoi(argv[3]));
+  } else {
+    res = ioctl(fd, RAM_DISK_IOC_SNAPSHOT);
+  }
+  close(fd);
+  if (res < 0) {
+    perror("ioctl");
+    return 1;
+  }
+  if (!delete) {
+    printf("%d\n", res);
+  }
+  return 0;
+}
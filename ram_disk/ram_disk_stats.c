@@ -0,0 +1,167 @@
+#include <linux/debugfs.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include "ram_disk.h"
+
+// I/O statistics. Every CPU updates its own counters with this_cpu ops,
+// so the hot path takes no locks and shares no cache lines. Readers sum
+// the counters of all CPUs, which can be slightly out of date but never
+// blocks an I/O.
+//
+// Latencies are measured from when the driver receives a request or bio
+// until it completes it, and are kept as log2 histograms: bucket i counts
+// latencies below 2^i nanoseconds (and at least 2^(i-1)).
+
+static const char* op_names[RAM_DISK_STAT_NR_OPS] = {
+    "read",
+    "write",
+    "discard",
+    "other",
+};
+
+static struct dentry* debugfs_root;
+
+struct ram_disk_cpu_stats {
+  u64 ops[RAM_DISK_STAT_NR_OPS];
+  u64 bytes[RAM_DISK_STAT_NR_OPS];
+  u64 segments[RAM_DISK_STAT_NR_OPS];
+  u64 segment_hist[RAM_DISK_STAT_BUCKETS];
+
+  // Only reads and writes have latency histograms.
+  u64 latency_hist[2][RAM_DISK_STAT_BUCKETS];
+};
+
+static enum ram_disk_stat_op stat_op(unsigned int op) {
+  switch (op) {
+    case REQ_OP_READ:
+      return RAM_DISK_STAT_READ;
+    case REQ_OP_WRITE:
+      return RAM_DISK_STAT_WRITE;
+    case REQ_OP_DISCARD:
+    case REQ_OP_WRITE_ZEROES:
+      return RAM_DISK_STAT_DISCARD;
+    default:
+      return RAM_DISK_STAT_OTHER;
+  }
+}
+
+static unsigned int bucket(u64 value) {
+  return min_t(unsigned int, fls64(value), RAM_DISK_STAT_BUCKETS - 1);
+}
+
+void ram_disk_stats_account(struct ram_disk* dev,
+                            unsigned int op,
+                            unsigned int bytes,
+                            unsigned int segments,
+                            u64 start_ns) {
+  struct ram_disk_cpu_stats __percpu* stats = dev->stats;
+  enum ram_disk_stat_op sop = stat_op(op);
+  this_cpu_inc(stats->ops[sop]);
+  this_cpu_add(stats->bytes[sop], bytes);
+  this_cpu_add(stats->segments[sop], segments);
+  if (sop == RAM_DISK_STAT_READ || sop == RAM_DISK_STAT_WRITE) {
+    u64 latency = ktime_get_ns() - start_ns;
+    this_cpu_inc(stats->segment_hist[bucket(segments)]);
+    this_cpu_inc(stats->latency_hist[sop][bucket(latency)]);
+  }
+}
+
+static void sum_stats(struct ram_disk* dev, struct ram_disk_cpu_stats* sum) {
+  int cpu;
+  int i;
+  int j;
+  memset(sum, 0, sizeof(*sum));
+  for_each_possible_cpu(cpu) {
+    struct ram_disk_cpu_stats* stats = per_cpu_ptr(dev->stats, cpu);
+    for (i = 0; i < RAM_DISK_STAT_NR_OPS; ++i) {
+      sum->ops[i] += stats->ops[i];
+      sum->bytes[i] += stats->bytes[i];
+      sum->segments[i] += stats->segments[i];
+    }
+    for (i = 0; i < RAM_DISK_STAT_BUCKETS; ++i) {
+      sum->segment_hist[i] += stats->segment_hist[i];
+      for (j = 0; j < 2; ++j) {
+        sum->latency_hist[j][i] += stats->latency_hist[j][i];
+      }
+    }
+  }
+}
+
+static void show_hist(struct seq_file* s, const char* name, u64* hist) {
+  int i;
+  seq_printf(s, "%s:", name);
+  for (i = 0; i < RAM_DISK_STAT_BUCKETS; ++i) {
+    seq_printf(s, " %llu", hist[i]);
+  }
+  seq_puts(s, "\n");
+}
+
+// One line per op, e.g. "read ops 10 bytes 40960 segments 10", followed by
+// the histograms as one line of bucket counts each.
+static int stats_show(struct seq_file* s, void* unused) {
+  struct ram_disk* dev = s->private;
+  struct ram_disk_cpu_stats* sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+  int i;
+  if (!sum) {
+    return -ENOMEM;
+  }
+  sum_stats(dev, sum);
+  for (i = 0; i < RAM_DISK_STAT_NR_OPS; ++i) {
+    seq_printf(s, "%s ops %llu bytes %llu segments %llu\n", op_names[i],
+               sum->ops[i], sum->bytes[i], sum->segments[i]);
+  }
+  show_hist(s, "segments_per_request", sum->segment_hist);
+  show_hist(s, "read_latency_ns", sum->latency_hist[RAM_DISK_STAT_READ]);
+  show_hist(s, "write_latency_ns", sum->latency_hist[RAM_DISK_STAT_WRITE]);
+  seq_printf(s, "cow_copies %lld\n",
+             (long long)atomic64_read(&dev->store.cow_copies));
+  seq_printf(s, "contended %llu\n", ram_disk_store_contended(&dev->store));
+  if (dev->store.huge) {
+    seq_printf(s, "huge_chunks %lld huge_fallbacks %lld\n",
+               (long long)atomic64_read(&dev->store.huge_chunks),
+               (long long)atomic64_read(&dev->store.huge_fallbacks));
+  }
+  ram_disk_numa_show(s, &dev->store.numa);
+  if (dev->backing) {
+    seq_printf(s, "writeback_pages %llu\n",
+               ram_disk_backing_flushed_pages(dev));
+  }
+  kfree(sum);
+  return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+int ram_disk_stats_init(struct ram_disk* dev) {
+  dev->stats = alloc_percpu(struct ram_disk_cpu_stats);
+  if (!dev->stats) {
+    return -ENOMEM;
+  }
+  return 0;
+}
+
+// Called once the disk has its name.
+void ram_disk_stats_register(struct ram_disk* dev) {
+  // debugfs failures are deliberately ignored; the disk works without it.
+  dev->debugfs_dir = debugfs_create_dir(dev->disk->disk_name, debugfs_root);
+  debugfs_create_file("stats", 0444, dev->debugfs_dir, dev, &stats_fops);
+}
+
+void ram_disk_stats_free(struct ram_disk* dev) {
+  debugfs_remove_recursive(dev->debugfs_dir);
+  dev->debugfs_dir = NULL;
+  free_percpu(dev->stats);
+  dev->stats = NULL;
+}
+
+void ram_disk_stats_module_init(void) {
+  debugfs_root = debugfs_create_dir(DRIVER_NAME, NULL);
+}
+
+void ram_disk_stats_module_exit(void) {
+  debugfs_remove_recursive(debugfs_root);
+}
@@ -0,0 +1,599 @@
+#include <linux/fs.h>
+#include <linux/gfp.h>
+#include <linux/highmem.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/pagemap.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
+#include "ram_disk.h"
+
+// Concurrency: the block layer doesn't order overlapping requests, so the
+// store only has to keep its own structures consistent, not serialize
+// I/O. Nothing on the uncompressed path takes a per-range lock:
+//
+//  * Reads look pages up with xa_load() under RCU and copy them without
+//    any lock, so readers never block each other or writers.
+//  * Overwriting a page this store owns alone is the same lookup followed
+//    by a memcpy, which is the common case once a disk has been filled.
+//    The page is locked around the memcpy, which only ever waits for
+//    another write to the same page or a fault mapping it (see
+//    invalidate()).
+//  * Only structural changes (inserting a fresh or copied page, or
+//    removing one on discard) take the xarray's lock, and only for the
+//    single update. Page allocation happens outside of it.
+//
+// Compressed stores lock striped mutexes instead (see ram_disk_comp.c), and
+// deduplicated stores lock a stripe around writing and merging each page
+// (see ram_disk_dedup.c). Every time any of these locks is found already
+// held, the per-CPU contended counter goes up, which is shown in the
+// debugfs stats file.
+
+// Size of the contiguous allocations made with huge_pages.
+#define RAM_DISK_HUGE_ORDER (21 - PAGE_SHIFT)
+#define RAM_DISK_HUGE_PAGES (1UL << RAM_DISK_HUGE_ORDER)
+
+int ram_disk_store_init(struct ram_disk_store* store,
+                        const struct ram_disk_config* config) {
+  int res;
+  xa_init(&store->pages);
+  store->size = (size_t)config->size_mb << 20;
+  store->gfp = GFP_NOIO | __GFP_ZERO | __GFP_HIGHMEM;
+  store->comp = NULL;
+  store->dedup = NULL;
+  store->huge = config->huge_pages;
+  store->mapping = NULL;
+  store->hole_page = NULL;
+  atomic64_set(&store->cow_copies, 0);
+  atomic64_set(&store->huge_chunks, 0);
+  atomic64_set(&store->huge_fallbacks, 0);
+  store->contended = alloc_percpu(unsigned long);
+  if (!store->contended) {
+    return -ENOMEM;
+  }
+  res = ram_disk_numa_init(&store->numa, config, &store->gfp);
+  if (res) {
+    free_percpu(store->contended);
+    return res;
+  }
+  if (config->compressor[0]) {
+    res = ram_disk_comp_init(store, config->compressor);
+  } else if (config->dedup) {
+    res = ram_disk_dedup_init(store);
+  }
+  if (res) {
+    ram_disk_numa_free(&store->numa);
+    free_percpu(store->contended);
+  }
+  return res;
+}
+
+void ram_disk_store_free(struct ram_disk_store* store) {
+  struct page* page;
+  unsigned long index;
+  if (store->comp) {
+    ram_disk_comp_free(store);
+  } else {
+    // Nothing can be reading the store anymore, but its pages may still be
+    // shared with a snapshot.
+    xa_for_each(&store->pages, index, page) {
+      put_page(page);
+    }
+  }
+  xa_destroy(&store->pages);
+  ram_disk_dedup_free(store);
+  ram_disk_numa_free(&store->numa);
+  free_percpu(store->contended);
+}
+
+u64 ram_disk_store_contended(struct ram_disk_store* store) {
+  u64 total = 0;
+  int cpu;
+  for_each_possible_cpu(cpu) {
+    total += *per_cpu_ptr(store->contended, cpu);
+  }
+  return total;
+}
+
+static void lock_pages(struct ram_disk_store* store) {
+  if (!xa_trylock(&store->pages)) {
+    this_cpu_inc(*store->contended);
+    xa_lock(&store->pages);
+  }
+}
+
+// Unmap a range from the store's mmap device after the pages there (or
+// the holes, mapped to the hole page) were replaced, if anything has it
+// mapped. Pages being dropped from the store must be unmapped before the
+// store's reference goes, so the last reference is still dropped through
+// RCU.
+//
+// A fault only returns a page locked, after checking that it's still in
+// the store, and the mm installs the mapping before unlocking it. So as
+// long as the old page is locked around the zap (by passing it as lock, or
+// by the caller), the zap either finds the new mapping or the fault sees
+// the replacement.
+static void invalidate(struct ram_disk_store* store,
+                       pgoff_t index,
+                       pgoff_t nr_pages,
+                       struct page* lock) {
+  if (store->mapping && mapping_mapped(store->mapping)) {
+    if (lock) {
+      lock_page(lock);
+    }
+    unmap_mapping_range(store->mapping, (loff_t)index << PAGE_SHIFT,
+                        (loff_t)nr_pages << PAGE_SHIFT, 1);
+    if (lock) {
+      unlock_page(lock);
+    }
+  }
+}
+
+static struct page* cmpxchg_page(struct ram_disk_store* store,
+                                 pgoff_t index,
+                                 struct page* old,
+                                 struct page* page) {
+  struct page* cur;
+  lock_pages(store);
+  cur = __xa_cmpxchg(&store->pages, index, old, page, GFP_NOIO);
+  xa_unlock(&store->pages);
+  return cur;
+}
+
+static bool in_bounds(struct ram_disk_store* store,
+                      sector_t sector,
+                      unsigned int len) {
+  size_t start = (size_t)sector << SECTOR_SHIFT;
+  if (start > store->size || store->size - start < len) {
+    printk(KERN_INFO "Out of bounds RAM disk access!");
+    return false;
+  }
+  return true;
+}
+
+static struct page* alloc_store_page(struct ram_disk_store* store,
+                                     pgoff_t index,
+                                     gfp_t gfp) {
+  return alloc_pages_node(ram_disk_numa_node(&store->numa, index), gfp, 0);
+}
+
+// Fill an empty, aligned 2 MiB range of the store with one physically
+// contiguous allocation, so that streaming through it stays within a
+// single TLB entry of the direct map. The allocation is split into normal
+// pages, which means the rest of the store (sharing, discard, mmap) never
+// has to know about it.
+//
+// Returns false if the range isn't empty or memory is too fragmented, in
+// which case the caller falls back to a single page.
+static bool insert_huge_chunk(struct ram_disk_store* store, pgoff_t index) {
+  pgoff_t base = round_down(index, RAM_DISK_HUGE_PAGES);
+  pgoff_t last = base + RAM_DISK_HUGE_PAGES - 1;
+  pgoff_t found = base;
+  struct page* page;
+  unsigned int i;
+  if (last >= DIV_ROUND_UP(store->size, PAGE_SIZE)) {
+    return false;
+  }
+  if (xa_find(&store->pages, &found, last, XA_PRESENT)) {
+    // Part of the range was already filled in with single pages.
+    return false;
+  }
+  page = alloc_pages_node(ram_disk_numa_node(&store->numa, base),
+                          store->gfp | __GFP_NORETRY | __GFP_NOWARN,
+                          RAM_DISK_HUGE_ORDER);
+  if (!page) {
+    atomic64_inc(&store->huge_fallbacks);
+    return false;
+  }
+  split_page(page, RAM_DISK_HUGE_ORDER);
+  lock_pages(store);
+  for (i = 0; i < RAM_DISK_HUGE_PAGES; ++i) {
+    struct page* cur = __xa_cmpxchg(&store->pages, base + i, NULL, page + i,
+                                    GFP_NOIO);
+    if (cur) {
+      // Lost a race with another writer, or the store failed.
+      __free_page(page + i);
+    }
+  }
+  xa_unlock(&store->pages);
+  invalidate(store, base, RAM_DISK_HUGE_PAGES, store->hole_page);
+  atomic64_inc(&store->huge_chunks);
+  return true;
+}
+
+// Make sure a page exists at the given index, allocating a zeroed one if
+// needed. This may sleep, which is why the blk-mq queue is marked as
+// blocking.
+static int insert_page(struct ram_disk_store* store, pgoff_t index) {
+  struct page* page;
+  struct page* cur;
+  if (store->huge && insert_huge_chunk(store, index)) {
+    // The caller will retry the lookup, and a failure to store the page
+    // it wanted just leads back here with a partial range.
+    return 0;
+  }
+  page = alloc_store_page(store, index, store->gfp);
+  if (!page) {
+    return -ENOMEM;
+  }
+  cur = cmpxchg_page(store, index, NULL, page);
+  if (cur) {
+    // Either the store failed, or a concurrent writer beat us to it.
+    __free_page(page);
+    return xa_is_err(cur) ? xa_err(cur) : 0;
+  }
+  // The hole may have been mapped to the hole page.
+  invalidate(store, index, 1, store->hole_page);
+  return 0;
+}
+
+static void free_page_rcu(struct rcu_head* head) {
+  __free_page(container_of(head, struct page, rcu_head));
+}
+
+// Each store holding a page owns one reference to it, so a page with more
+// than one reference is shared with a snapshot and must not be modified.
+//
+// Readers and writers only touch a page inside an RCU read-side critical
+// section without taking a reference, so the last reference is dropped
+// after a grace period instead of right away.
+static void put_store_page(struct page* page) {
+  if (!page_ref_add_unless(page, -1, 1)) {
+    call_rcu(&page->rcu_head, free_page_rcu);
+  }
+}
+
+static void remove_page(struct ram_disk_store* store, pgoff_t index) {
+  struct page* page;
+  lock_pages(store);
+  page = __xa_erase(&store->pages, index);
+  xa_unlock(&store->pages);
+  if (page) {
+    invalidate(store, index, 1, page);
+    put_store_page(page);
+  }
+}
+
+// Give this store a private copy of a shared page, which the caller has
+// locked (so nothing writes to it during the copy) and holds a reference
+// to.
+static int copy_shared_page(struct ram_disk_store* store,
+                            pgoff_t index,
+                            struct page* old) {
+  struct page* page = alloc_store_page(store, index, store->gfp & ~__GFP_ZERO);
+  struct page* cur;
+  if (!page) {
+    return -ENOMEM;
+  }
+  copy_highpage(page, old);
+  cur = cmpxchg_page(store, index, old, page);
+  if (cur != old) {
+    // Either the store failed, or a concurrent writer already replaced it.
+    __free_page(page);
+    return xa_is_err(cur) ? xa_err(cur) : 0;
+  }
+  atomic64_inc(&store->cow_copies);
+  invalidate(store, index, 1, NULL);
+  put_store_page(old);
+  return 0;
+}
+
+// Copy part of a page into the store, or zero it if src is NULL.
+//
+// The page is written in place only if this store is its sole owner, which
+// is checked with the page locked: faults take their reference to a page
+// before locking it to map it, so a page that passes the check can't be
+// mapped until the write is done.
+static int write_chunk(struct ram_disk_store* store,
+                       pgoff_t index,
+                       unsigned int page_off,
+                       struct page* src_page,
+                       unsigned int src_off,
+                       unsigned int chunk) {
+  struct page* page;
+  // Whether this holds a reference to the page, instead of relying on RCU
+  // to keep it around.
+  bool held;
+  char* dst;
+  int res;
+  for (;;) {
+    rcu_read_lock();
+    page = xa_load(&store->pages, index);
+    if (!page) {
+      rcu_read_unlock();
+      if (!src_page) {
+        // Already reads as zeroes.
+        return 0;
+      }
+      res = insert_page(store, index);
+      if (res) {
+        return res;
+      }
+      continue;
+    }
+    held = !trylock_page(page);
+    if (held) {
+      this_cpu_inc(*store->contended);
+      get_page(page);
+      rcu_read_unlock();
+      lock_page(page);
+    }
+    res = 0;
+    if (xa_load(&store->pages, index) == page) {
+      if (page_ref_count(page) == 1 + held) {
+        break;
+      }
+      if (!held) {
+        // Hold on to the shared page while allocating its replacement.
+        get_page(page);
+        rcu_read_unlock();
+        held = true;
+      }
+      res = copy_shared_page(store, index, page);
+    }
+    // Either way, the store has a different page now.
+    unlock_page(page);
+    if (held) {
+      put_store_page(page);
+    } else {
+      rcu_read_unlock();
+    }
+    if (res) {
+      return res;
+    }
+  }
+  ram_disk_numa_account(&store->numa, page);
+  dst = kmap_atomic(page);
+  if (src_page) {
+    char* src = kmap_atomic(src_page);
+    memcpy(dst + page_off, src + src_off, chunk);
+    kunmap_atomic(src);
+  } else {
+    memset(dst + page_off, 0, chunk);
+  }
+  kunmap_atomic(dst);
+  unlock_page(page);
+  if (held) {
+    put_store_page(page);
+  } else {
+    rcu_read_unlock();
+  }
+  return 0;
+}
+
+static bool pages_equal(struct page* a, struct page* b) {
+  char* a_data = kmap_atomic(a);
+  char* b_data = kmap_atomic(b);
+  bool res = !memcmp(a_data, b_data, PAGE_SIZE);
+  kunmap_atomic(b_data);
+  kunmap_atomic(a_data);
+  return res;
+}
+
+static struct page* get_store_page(struct ram_disk_store* store,
+                                   pgoff_t index) {
+  struct page* page;
+  rcu_read_lock();
+  page = xa_load(&store->pages, index);
+  if (page) {
+    get_page(page);
+  }
+  rcu_read_unlock();
+  return page;
+}
+
+// Share an existing page with the same contents as the one just written
+// at index, if there is one. The stripe lock for index must be held.
+static void dedup_page(struct ram_disk_store* store,
+                       pgoff_t index,
+                       struct mutex* held) {
+  struct page* page = get_store_page(store, index);
+  struct page* other;
+  struct mutex* lock;
+  pgoff_t match;
+  u32 hash;
+
+  if (!page) {
+    return;
+  }
+  hash = ram_disk_dedup_hash(store, page);
+  if (!ram_disk_dedup_find(store, hash, index, &match)) {
+    goto out;
+  }
+
+  // The matched page can't be compared while it is being written, but
+  // waiting for its writer could deadlock with that writer doing the same
+  // for this index, so don't bother if it's busy.
+  lock = ram_disk_dedup_stripe(store, match);
+  if (lock != held && !mutex_trylock(lock)) {
+    this_cpu_inc(*store->contended);
+    goto out;
+  }
+  other = get_store_page(store, match);
+  if (other && other != page && pages_equal(page, other)) {
+    // Give the store a reference to the shared page, replacing its
+    // reference to its own. This only fails if a discard got here first.
+    get_page(other);
+    if (cmpxchg_page(store, index, page, other) == page) {
+      invalidate(store, index, 1, page);
+      put_store_page(page);
+      ram_disk_dedup_merged(store);
+    } else {
+      put_store_page(other);
+    }
+  } else if (other != page) {
+    ram_disk_dedup_mismatch(store, hash, match, index);
+  }
+  if (other) {
+    put_store_page(other);
+  }
+  if (lock != held) {
+    mutex_unlock(lock);
+  }
+
+out:
+  put_store_page(page);
+}
+
+// Copy part of a page into the store, or zero it if src is NULL, and
+// deduplicate the result if enabled.
+static int write_page(struct ram_disk_store* store,
+                      pgoff_t index,
+                      unsigned int page_off,
+                      struct page* src_page,
+                      unsigned int src_off,
+                      unsigned int chunk) {
+  struct mutex* lock;
+  int res;
+  if (!store->dedup) {
+    return write_chunk(store, index, page_off, src_page, src_off, chunk);
+  }
+  lock = ram_disk_dedup_stripe(store, index);
+  if (!mutex_trylock(lock)) {
+    this_cpu_inc(*store->contended);
+    mutex_lock(lock);
+  }
+  res = write_chunk(store, index, page_off, src_page, src_off, chunk);
+  if (!res) {
+    dedup_page(store, index, lock);
+  }
+  mutex_unlock(lock);
+  return res;
+}
+
+blk_status_t ram_disk_store_read(struct ram_disk_store* store,
+                                 struct page* page,
+                                 unsigned int offset,
+                                 unsigned int len,
+                                 sector_t sector) {
+  size_t pos = (size_t)sector << SECTOR_SHIFT;
+  char* dst;
+  if (!in_bounds(store, sector, len)) {
+    return BLK_STS_IOERR;
+  }
+  if (store->comp) {
+    return ram_disk_comp_read(store, page, offset, len, sector);
+  }
+  dst = kmap_atomic(page);
+  while (len) {
+    unsigned int page_off = offset_in_page(pos);
+    unsigned int chunk = min_t(unsigned int, len, PAGE_SIZE - page_off);
+    struct page* src_page;
+    rcu_read_lock();
+    src_page = xa_load(&store->pages, pos >> PAGE_SHIFT);
+    if (src_page) {
+      char* src = kmap_atomic(src_page);
+      ram_disk_numa_account(&store->numa, src_page);
+      memcpy(dst + offset, src + page_off, chunk);
+      kunmap_atomic(src);
+    } else {
+      // Never written (or discarded), so it reads back as zeroes.
+      memset(dst + offset, 0, chunk);
+    }
+    rcu_read_unlock();
+    pos += chunk;
+    offset += chunk;
+    len -= chunk;
+  }
+  kunmap_atomic(dst);
+  return BLK_STS_OK;
+}
+
+blk_status_t ram_disk_store_write(struct ram_disk_store* store,
+                                  struct page* page,
+                                  unsigned int offset,
+                                  unsigned int len,
+                                  sector_t sector) {
+  size_t pos = (size_t)sector << SECTOR_SHIFT;
+  if (!in_bounds(store, sector, len)) {
+    return BLK_STS_IOERR;
+  }
+  if (store->comp) {
+    return ram_disk_comp_write(store, page, offset, len, sector);
+  }
+  while (len) {
+    unsigned int page_off = offset_in_page(pos);
+    unsigned int chunk = min_t(unsigned int, len, PAGE_SIZE - page_off);
+    if (write_page(store, pos >> PAGE_SHIFT, page_off, page, offset,
+                   chunk)) {
+      return BLK_STS_RESOURCE;
+    }
+    pos += chunk;
+    offset += chunk;
+    len -= chunk;
+  }
+  return BLK_STS_OK;
+}
+
+// Used for both REQ_OP_DISCARD and REQ_OP_WRITE_ZEROES. Whole pages are
+// dropped from the store, which both returns them to the system and makes
+// them read back as zeroes. Only the partial pages at either end of the
+// range are actually cleared.
+blk_status_t ram_disk_store_discard(struct ram_disk_store* store,
+                                    sector_t sector,
+                                    unsigned int len) {
+  size_t pos = (size_t)sector << SECTOR_SHIFT;
+  size_t end = pos + len;
+  if (!in_bounds(store, sector, len)) {
+    return BLK_STS_IOERR;
+  }
+  if (store->comp) {
+    return ram_disk_comp_discard(store, sector, len);
+  }
+  while (pos < end) {
+    pgoff_t index = pos >> PAGE_SHIFT;
+    unsigned int page_off = offset_in_page(pos);
+    unsigned int chunk = min_t(size_t, end - pos, PAGE_SIZE - page_off);
+    if (chunk == PAGE_SIZE) {
+      remove_page(store, index);
+    } else if (write_page(store, index, page_off, NULL, 0, chunk)) {
+      return BLK_STS_RESOURCE;
+    }
+    pos += chunk;
+  }
+  return BLK_STS_OK;
+}
+
+// Get the page at an index for mapping it into userspace, or the hole page
+// for a hole, with a reference for the mapping. The page is returned
+// locked, so a fault can return it with VM_FAULT_LOCKED and nothing can
+// replace it without seeing the mapping (see invalidate()).
+struct page* ram_disk_store_map_page(struct ram_disk_store* store,
+                                     pgoff_t index) {
+  for (;;) {
+    struct page* page = get_store_page(store, index);
+    struct page* mapped = page ? page : store->hole_page;
+    if (!page) {
+      get_page(mapped);
+    }
+    lock_page(mapped);
+    if (xa_load(&store->pages, index) == page) {
+      return mapped;
+    }
+    unlock_page(mapped);
+    if (page) {
+      put_store_page(page);
+    } else {
+      put_page(mapped);
+    }
+  }
+}
+
+// Make dst share every page of src. Both stores must be quiesced, and
+// neither may be compressed.
+int ram_disk_store_clone(struct ram_disk_store* dst,
+                         struct ram_disk_store* src) {
+  struct page* page;
+  unsigned long index;
+  xa_for_each(&src->pages, index, page) {
+    void* old;
+    get_page(page);
+    old = xa_store(&dst->pages, index, page, GFP_KERNEL);
+    if (xa_is_err(old)) {
+      put_page(page);
+      return xa_err(old);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,245 @@
+#include <linux/device.h>
+#include <linux/genhd.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/sysfs.h>
+#include "ram_disk.h"
+
+// Attribute groups under /sys/block/ramdiskN. Each group is only visible
+// when the feature it describes is enabled for that disk.
+
+static struct ram_disk* dev_to_ram_disk(struct device* dev) {
+  return dev_to_disk(dev)->private_data;
+}
+
+// Compression
+
+// Prints a fixed-point number with two decimal places.
+static ssize_t show_ratio(char* buf, u64 num, u64 denom) {
+  u64 scaled = denom ? div64_u64(num * 100, denom) : 0;
+  return sprintf(buf, "%llu.%02llu\n", scaled / 100, scaled % 100);
+}
+
+static ssize_t comp_algorithm_show(struct device* dev,
+                                   struct device_attribute* attr,
+                                   char* buf) {
+  struct ram_disk_comp_stats stats;
+  ram_disk_comp_get_stats(&dev_to_ram_disk(dev)->store, &stats);
+  return sprintf(buf, "%s\n", stats.algorithm);
+}
+
+static ssize_t comp_orig_data_size_show(struct device* dev,
+                                        struct device_attribute* attr,
+                                        char* buf) {
+  struct ram_disk_comp_stats stats;
+  ram_disk_comp_get_stats(&dev_to_ram_disk(dev)->store, &stats);
+  return sprintf(buf, "%llu\n", stats.stored_pages << PAGE_SHIFT);
+}
+
+static ssize_t comp_compr_data_size_show(struct device* dev,
+                                         struct device_attribute* attr,
+                                         char* buf) {
+  struct ram_disk_comp_stats stats;
+  ram_disk_comp_get_stats(&dev_to_ram_disk(dev)->store, &stats);
+  return sprintf(buf, "%llu\n", stats.compr_size);
+}
+
+static ssize_t comp_same_pages_show(struct device* dev,
+                                    struct device_attribute* attr,
+                                    char* buf) {
+  struct ram_disk_comp_stats stats;
+  ram_disk_comp_get_stats(&dev_to_ram_disk(dev)->store, &stats);
+  return sprintf(buf, "%llu\n", stats.same_pages);
+}
+
+// Original size divided by the memory actually used for page data.
+static ssize_t comp_ratio_show(struct device* dev,
+                               struct device_attribute* attr,
+                               char* buf) {
+  struct ram_disk_comp_stats stats;
+  ram_disk_comp_get_stats(&dev_to_ram_disk(dev)->store, &stats);
+  return show_ratio(buf, stats.stored_pages << PAGE_SHIFT, stats.compr_size);
+}
+
+static ssize_t comp_compress_ops_show(struct device* dev,
+                                      struct device_attribute* attr,
+                                      char* buf) {
+  struct ram_disk_comp_stats stats;
+  ram_disk_comp_get_stats(&dev_to_ram_disk(dev)->store, &stats);
+  return sprintf(buf, "%llu\n", stats.compress_ops);
+}
+
+// Average time per page, in nanoseconds.
+static ssize_t comp_compress_ns_show(struct device* dev,
+                                     struct device_attribute* attr,
+                                     char* buf) {
+  struct ram_disk_comp_stats stats;
+  ram_disk_comp_get_stats(&dev_to_ram_disk(dev)->store, &stats);
+  return sprintf(buf, "%llu\n",
+                 stats.compress_ops
+                     ? div64_u64(stats.compress_ns, stats.compress_ops)
+                     : 0);
+}
+
+static ssize_t comp_decompress_ops_show(struct device* dev,
+                                        struct device_attribute* attr,
+                                        char* buf) {
+  struct ram_disk_comp_stats stats;
+  ram_disk_comp_get_stats(&dev_to_ram_disk(dev)->store, &stats);
+  return sprintf(buf, "%llu\n", stats.decompress_ops);
+}
+
+static ssize_t comp_decompress_ns_show(struct device* dev,
+                                       struct device_attribute* attr,
+                                       char* buf) {
+  struct ram_disk_comp_stats stats;
+  ram_disk_comp_get_stats(&dev_to_ram_disk(dev)->store, &stats);
+  return sprintf(buf, "%llu\n",
+                 stats.decompress_ops
+                     ? div64_u64(stats.decompress_ns, stats.decompress_ops)
+                     : 0);
+}
+
+#define COMP_ATTR(name) \
+  static struct device_attribute comp_attr_##name = \
+      __ATTR(name, 0444, comp_##name##_show, NULL)
+
+COMP_ATTR(algorithm);
+COMP_ATTR(orig_data_size);
+COMP_ATTR(compr_data_size);
+COMP_ATTR(same_pages);
+COMP_ATTR(ratio);
+COMP_ATTR(compress_ops);
+COMP_ATTR(compress_ns);
+COMP_ATTR(decompress_ops);
+COMP_ATTR(decompress_ns);
+
+static struct attribute* comp_group_attrs[] = {
+    &comp_attr_algorithm.attr,
+    &comp_attr_orig_data_size.attr,
+    &comp_attr_compr_data_size.attr,
+    &comp_attr_same_pages.attr,
+    &comp_attr_ratio.attr,
+    &comp_attr_compress_ops.attr,
+    &comp_attr_compress_ns.attr,
+    &comp_attr_decompress_ops.attr,
+    &comp_attr_decompress_ns.attr,
+    NULL,
+};
+
+static umode_t comp_is_visible(struct kobject* kobj,
+                               struct attribute* attr,
+                               int index) {
+  struct device* dev = kobj_to_dev(kobj);
+  return dev_to_ram_disk(dev)->store.comp ? attr->mode : 0;
+}
+
+static const struct attribute_group comp_group = {
+    .name = "compression",
+    .attrs = comp_group_attrs,
+    .is_visible = comp_is_visible,
+};
+
+// Deduplication
+
+static ssize_t dedup_orig_data_size_show(struct device* dev,
+                                         struct device_attribute* attr,
+                                         char* buf) {
+  struct ram_disk_dedup_stats stats;
+  ram_disk_dedup_get_stats(&dev_to_ram_disk(dev)->store, &stats);
+  return sprintf(buf, "%llu\n", stats.stored_pages << PAGE_SHIFT);
+}
+
+static ssize_t dedup_mem_used_show(struct device* dev,
+                                   struct device_attribute* attr,
+                                   char* buf) {
+  struct ram_disk_dedup_stats stats;
+  ram_disk_dedup_get_stats(&dev_to_ram_disk(dev)->store, &stats);
+  return sprintf(buf, "%llu\n", stats.mem_used);
+}
+
+static ssize_t dedup_ratio_show(struct device* dev,
+                                struct device_attribute* attr,
+                                char* buf) {
+  struct ram_disk_dedup_stats stats;
+  ram_disk_dedup_get_stats(&dev_to_ram_disk(dev)->store, &stats);
+  return show_ratio(buf, stats.stored_pages << PAGE_SHIFT, stats.mem_used);
+}
+
+static ssize_t dedup_hashed_pages_show(struct device* dev,
+                                       struct device_attribute* attr,
+                                       char* buf) {
+  struct ram_disk_dedup_stats stats;
+  ram_disk_dedup_get_stats(&dev_to_ram_disk(dev)->store, &stats);
+  return sprintf(buf, "%llu\n", stats.hashed_pages);
+}
+
+// Average time per page, in nanoseconds.
+static ssize_t dedup_hash_ns_show(struct device* dev,
+                                  struct device_attribute* attr,
+                                  char* buf) {
+  struct ram_disk_dedup_stats stats;
+  ram_disk_dedup_get_stats(&dev_to_ram_disk(dev)->store, &stats);
+  return sprintf(buf, "%llu\n",
+                 stats.hashed_pages
+                     ? div64_u64(stats.hash_ns, stats.hashed_pages)
+                     : 0);
+}
+
+static ssize_t dedup_merged_pages_show(struct device* dev,
+                                       struct device_attribute* attr,
+                                       char* buf) {
+  struct ram_disk_dedup_stats stats;
+  ram_disk_dedup_get_stats(&dev_to_ram_disk(dev)->store, &stats);
+  return sprintf(buf, "%llu\n", stats.merged_pages);
+}
+
+static ssize_t dedup_mismatches_show(struct device* dev,
+                                     struct device_attribute* attr,
+                                     char* buf) {
+  struct ram_disk_dedup_stats stats;
+  ram_disk_dedup_get_stats(&dev_to_ram_disk(dev)->store, &stats);
+  return sprintf(buf, "%llu\n", stats.mismatches);
+}
+
+#define DEDUP_ATTR(name) \
+  static struct device_attribute dedup_attr_##name = \
+      __ATTR(name, 0444, dedup_##name##_show, NULL)
+
+DEDUP_ATTR(orig_data_size);
+DEDUP_ATTR(mem_used);
+DEDUP_ATTR(ratio);
+DEDUP_ATTR(hashed_pages);
+DEDUP_ATTR(hash_ns);
+DEDUP_ATTR(merged_pages);
+DEDUP_ATTR(mismatches);
+
+static struct attribute* dedup_group_attrs[] = {
+    &dedup_attr_orig_data_size.attr,
+    &dedup_attr_mem_used.attr,
+    &dedup_attr_ratio.attr,
+    &dedup_attr_hashed_pages.attr,
+    &dedup_attr_hash_ns.attr,
+    &dedup_attr_merged_pages.attr,
+    &dedup_attr_mismatches.attr,
+    NULL,
+};
+
+static umode_t dedup_is_visible(struct kobject* kobj,
+                                struct attribute* attr,
+                                int index) {
+  struct device* dev = kobj_to_dev(kobj);
+  return dev_to_ram_disk(dev)->store.dedup ? attr->mode : 0;
+}
+
+static const struct attribute_group dedup_group = {
+    .name = "dedup",
+    .attrs = dedup_group_attrs,
+    .is_visible = dedup_is_visible,
+};
+
+const struct attribute_group* ram_disk_attr_groups[] = {
+    &comp_group,
+    &dedup_group,
+    NULL,
+};
@@ -0,0 +1,141 @@
+#include <linux/atomic.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/string.h>
+#include "ram_disk.h"
+
+// Emulation of slower storage. Each direction has a fixed latency added
+// to every request, and a bandwidth ceiling enforced by a token bucket:
+// a request of n bytes costs n / bandwidth of device time, and the bucket
+// can hold up to RAM_DISK_THROTTLE_BURST_NS worth of unused time, so a
+// device that has been idle can briefly exceed its ceiling like a real
+// one.
+//
+// The bucket is kept as the time at which all of the work admitted so far
+// will be done, which lets every queue charge it with one cmpxchg instead
+// of taking a lock.
+//
+// The copy itself still happens in ram_disk_queue_rq(); only the
+// completion is held back, with an hrtimer per request.
+
+#define RAM_DISK_THROTTLE_BURST_NS NSEC_PER_MSEC
+
+struct ram_disk_profile {
+  const char* name;
+  unsigned int hw_queues;
+  unsigned int queue_depth;
+  unsigned int read_latency_us;
+  unsigned int write_latency_us;
+  unsigned int read_mbps;
+  unsigned int write_mbps;
+};
+
+// Rough figures for typical drives of each kind. Write latency is lower
+// than read latency because drives acknowledge writes from their cache.
+static const struct ram_disk_profile profiles[] = {
+    {
+        .name = "nvme-gen4",
+        .hw_queues = 0,
+        .queue_depth = 1023,
+        .read_latency_us = 80,
+        .write_latency_us = 20,
+        .read_mbps = 7000,
+        .write_mbps = 5000,
+    },
+    {
+        .name = "sata-ssd",
+        .hw_queues = 1,
+        .queue_depth = 32,
+        .read_latency_us = 100,
+        .write_latency_us = 50,
+        .read_mbps = 550,
+        .write_mbps = 520,
+    },
+};
+
+static void init_dir(struct ram_disk_throttle_dir* dir,
+                     unsigned int latency_us,
+                     unsigned int mbps) {
+  dir->latency_ns = (u64)latency_us * NSEC_PER_USEC;
+  dir->mbps = mbps;
+  atomic64_set(&dir->next_ns, 0);
+}
+
+int ram_disk_throttle_init(struct ram_disk_throttle* throttle,
+                           const struct ram_disk_config* config) {
+  const struct ram_disk_profile* profile = NULL;
+  struct ram_disk_profile custom;
+  int i;
+
+  if (config->profile[0] && !sysfs_streq(config->profile, "none")) {
+    for (i = 0; i < ARRAY_SIZE(profiles); ++i) {
+      if (sysfs_streq(config->profile, profiles[i].name)) {
+        profile = &profiles[i];
+        break;
+      }
+    }
+    if (!profile) {
+      return -EINVAL;
+    }
+  }
+
+  // Explicitly configured values take precedence over the profile.
+  memset(&custom, 0, sizeof(custom));
+  if (profile) {
+    custom = *profile;
+  }
+  if (config->read_latency_us) {
+    custom.read_latency_us = config->read_latency_us;
+  }
+  if (config->write_latency_us) {
+    custom.write_latency_us = config->write_latency_us;
+  }
+  if (config->read_mbps) {
+    custom.read_mbps = config->read_mbps;
+  }
+  if (config->write_mbps) {
+    custom.write_mbps = config->write_mbps;
+  }
+
+  throttle->hw_queues = custom.hw_queues;
+  throttle->queue_depth = custom.queue_depth;
+  init_dir(&throttle->dirs[READ], custom.read_latency_us, custom.read_mbps);
+  init_dir(&throttle->dirs[WRITE], custom.write_latency_us, custom.write_mbps);
+  throttle->enabled = custom.read_latency_us || custom.write_latency_us ||
+                      custom.read_mbps || custom.write_mbps;
+  if (throttle->enabled && config->bio_mode) {
+    // Bios are completed inline, so there is nowhere to hold them back.
+    return -EINVAL;
+  }
+  return 0;
+}
+
+// Get the time (in ktime_get_ns() terms) at which a request that arrived
+// at now should complete.
+u64 ram_disk_throttle_deadline(struct ram_disk_throttle* throttle,
+                               bool is_write,
+                               unsigned int bytes,
+                               u64 now) {
+  struct ram_disk_throttle_dir* dir = &throttle->dirs[is_write];
+  u64 cost;
+  u64 next;
+  u64 done;
+
+  if (!dir->mbps || !bytes) {
+    return now + dir->latency_ns;
+  }
+  // One MB/s moves a byte every 1000ns.
+  cost = div_u64((u64)bytes * 1000, dir->mbps);
+  next = atomic64_read(&dir->next_ns);
+  for (;;) {
+    u64 start = max(next, now - min(now, (u64)RAM_DISK_THROTTLE_BURST_NS));
+    u64 old;
+    done = start + cost;
+    old = atomic64_cmpxchg(&dir->next_ns, next, done);
+    if (old == next) {
+      break;
+    }
+    next = old;
+  }
+  return max(done, now) + dir->latency_ns;
+}
@@ -0,0 +1,460 @@
+// Packs a tar file into a virt_fs image, which the module can use in place
+// without parsing it. See virt_fs_image.h for the format.
+//
+// Usage: mkimage [-c lz4|zstd] [-s chunk_size] input.tar output.img
+//
+// Each compressor is only available if its library was found at build time
+// (HAVE_LZ4 and HAVE_ZSTD).
+
+#include <endian.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "virt_fs_image.h"
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define DEFAULT_CHUNK_SIZE (64 << 10)
+#define ZSTD_LEVEL 19
+
+struct node {
+  const char* name;
+  int name_len;
+  int is_dir;
+
+  const char* data;
+  uint64_t size;
+
+  struct node** children;
+  int nr_children;
+  int cap_children;
+
+  // Directories also hash their children by name, in a table that doubles
+  // whenever it has more children than buckets.
+  struct node** buckets;
+  int bucket_bits;
+  struct node* hash_next;
+
+  uint32_t index;
+  uint64_t data_offset;
+};
+
+static void* xrealloc(void* ptr, size_t size) {
+  ptr = realloc(ptr, size);
+  if (!ptr) {
+    perror("realloc");
+    exit(1);
+  }
+  return ptr;
+}
+
+static char* read_file(const char* path, size_t* size) {
+  FILE* f = fopen(path, "rb");
+  char* data = NULL;
+  size_t cap = 0;
+  if (!f) {
+    perror(path);
+    exit(1);
+  }
+  *size = 0;
+  while (1) {
+    if (*size == cap) {
+      cap = cap ? cap * 2 : 1 << 20;
+      data = xrealloc(data, cap);
+    }
+    size_t got = fread(data + *size, 1, cap - *size, f);
+    if (!got) {
+      break;
+    }
+    *size += got;
+  }
+  if (ferror(f)) {
+    perror(path);
+    exit(1);
+  }
+  fclose(f);
+  return data;
+}
+
+static struct node* new_node(const char* name, int name_len, int is_dir) {
+  struct node* node = xrealloc(NULL, sizeof(struct node));
+  memset(node, 0, sizeof(*node));
+  node->name = name;
+  node->name_len = name_len;
+  node->is_dir = is_dir;
+  return node;
+}
+
+static uint32_t hash_name(const char* name, int len) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static struct node** child_bucket(struct node* dir,
+                                  const char* name,
+                                  int len) {
+  return &dir->buckets[hash_name(name, len) & ((1u << dir->bucket_bits) - 1)];
+}
+
+static struct node* find_child(struct node* dir, const char* name, int len) {
+  if (!dir->buckets) {
+    return NULL;
+  }
+  for (struct node* child = *child_bucket(dir, name, len); child;
+       child = child->hash_next) {
+    if (child->name_len == len && !memcmp(child->name, name, len)) {
+      return child;
+    }
+  }
+  return NULL;
+}
+
+static void hash_child(struct node* dir, struct node* child) {
+  struct node** bucket = child_bucket(dir, child->name, child->name_len);
+  child->hash_next = *bucket;
+  *bucket = child;
+}
+
+static void add_child(struct node* dir, struct node* child) {
+  if (dir->nr_children == dir->cap_children) {
+    dir->cap_children = dir->cap_children ? dir->cap_children * 2 : 4;
+    dir->children = xrealloc(dir->children,
+                             dir->cap_children * sizeof(struct node*));
+  }
+  dir->children[dir->nr_children++] = child;
+  if (dir->buckets && dir->nr_children <= 1 << dir->bucket_bits) {
+    hash_child(dir, child);
+    return;
+  }
+  dir->bucket_bits = dir->buckets ? dir->bucket_bits + 1 : 2;
+  free(dir->buckets);
+  dir->buckets = xrealloc(NULL, sizeof(struct node*) << dir->bucket_bits);
+  memset(dir->buckets, 0, sizeof(struct node*) << dir->bucket_bits);
+  for (int i = 0; i < dir->nr_children; i++) {
+    hash_child(dir, dir->children[i]);
+  }
+}
+
+// Add an entry the same way the module indexes a tar: every directory
+// leading up to it needs an entry of its own, earlier in the tar.
+static struct node* add_entry(struct node* root, const char* path) {
+  int len = strlen(path);
+  int is_dir = path[len - 1] == '/';
+  const char* base = path;
+  const char* name = path;
+  struct node* dir = root;
+  struct node* node;
+  for (int i = 0; i + 1 < len; i++) {
+    if (path[i] == '/') {
+      base = path + i + 1;
+    }
+  }
+  while (name < base) {
+    const char* slash = strchr(name, '/');
+    dir = find_child(dir, name, slash - name);
+    if (!dir || !dir->is_dir) {
+      fprintf(stderr, "%s: parent directory is missing\n", path);
+      exit(1);
+    }
+    name = slash + 1;
+  }
+
+  int base_len = path + len - is_dir - base;
+  node = find_child(dir, base, base_len);
+  if (node) {
+    if (node->is_dir != is_dir) {
+      fprintf(stderr, "%s is both a file and a directory\n", path);
+      exit(1);
+    }
+    return node;
+  }
+  node = new_node(base, base_len, is_dir);
+  add_child(dir, node);
+  return node;
+}
+
+// Must order names the same way as the module's binary search.
+static int compare_nodes(const void* a, const void* b) {
+  const struct node* x = *(struct node* const*)a;
+  const struct node* y = *(struct node* const*)b;
+  int len = x->name_len < y->name_len ? x->name_len : y->name_len;
+  int res = memcmp(x->name, y->name, len);
+  if (res) {
+    return res;
+  }
+  return x->name_len - y->name_len;
+}
+
+static int count_nodes(struct node* node) {
+  int count = 1;
+  for (int i = 0; i < node->nr_children; i++) {
+    count += count_nodes(node->children[i]);
+  }
+  return count;
+}
+
+static uint64_t align_up(uint64_t x, uint64_t align) {
+  return (x + align - 1) / align * align;
+}
+
+static void read_tar(struct node* root, const char* data, size_t size) {
+  for (size_t offset = 0; offset + 512 <= size; offset += 512) {
+    const char* name = data + offset;
+    char size_str[13];
+    struct node* node;
+    if (!name[0]) {
+      continue;
+    }
+    if (!memchr(name, 0, 100)) {
+      fprintf(stderr, "name at offset %zu is too long\n", offset);
+      exit(1);
+    }
+    node = add_entry(root, name);
+    if (node->is_dir) {
+      continue;
+    }
+    memset(size_str, 0, sizeof(size_str));
+    memcpy(size_str, data + offset + 124, 12);
+    node->size = strtoull(size_str, NULL, 8);
+    if (node->size > size - offset - 512) {
+      fprintf(stderr, "%s runs past the end of the tar\n", name);
+      exit(1);
+    }
+    node->data = data + offset + 512;
+    offset += align_up(node->size, 512);
+  }
+}
+
+// Compress a chunk, returning 0 if it didn't get any smaller.
+static size_t compress_chunk(const char* compressor,
+                             const char* src,
+                             size_t len,
+                             char* dst) {
+#ifdef HAVE_LZ4
+  if (!strcmp(compressor, "lz4")) {
+    int res = LZ4_compress_default(src, dst, len, len - 1);
+    return res > 0 ? res : 0;
+  }
+#endif
+#ifdef HAVE_ZSTD
+  if (!strcmp(compressor, "zstd")) {
+    size_t res = ZSTD_compress(dst, len - 1, src, len, ZSTD_LEVEL);
+    return ZSTD_isError(res) ? 0 : res;
+  }
+#endif
+  return 0;
+}
+
+static int have_compressor(const char* compressor) {
+#ifdef HAVE_LZ4
+  if (!strcmp(compressor, "lz4")) {
+    return 1;
+  }
+#endif
+#ifdef HAVE_ZSTD
+  if (!strcmp(compressor, "zstd")) {
+    return 1;
+  }
+#endif
+  return 0;
+}
+
+// Append the data, compressed in chunks, to an image that ends with the
+// chunk table.
+static char* compress_data(char* image,
+                           uint64_t* image_size,
+                           const char* data,
+                           uint64_t data_size,
+                           const char* compressor,
+                           uint32_t chunk_size) {
+  struct virt_fs_image_header* header = (struct virt_fs_image_header*)image;
+  uint32_t nr_chunks = (data_size + chunk_size - 1) / chunk_size;
+  uint64_t chunks_offset = le64toh(header->chunks_offset);
+  uint64_t size = chunks_offset + (nr_chunks + 1) * sizeof(uint64_t);
+  char* buffer = xrealloc(NULL, chunk_size);
+  uint64_t* offsets = xrealloc(NULL, (nr_chunks + 1) * sizeof(uint64_t));
+
+  image = xrealloc(image, size);
+  for (uint32_t i = 0; i < nr_chunks; i++) {
+    const char* src = data + (uint64_t)i * chunk_size;
+    size_t len = data_size - (uint64_t)i * chunk_size;
+    if (len > chunk_size) {
+      len = chunk_size;
+    }
+    size_t compressed = compress_chunk(compressor, src, len, buffer);
+    if (compressed) {
+      src = buffer;
+      len = compressed;
+    }
+    offsets[i] = htole64(size);
+    image = xrealloc(image, size + len);
+    memcpy(image + size, src, len);
+    size += len;
+  }
+  offsets[nr_chunks] = htole64(size);
+  memcpy(image + chunks_offset, offsets, (nr_chunks + 1) * sizeof(uint64_t));
+
+  header = (struct virt_fs_image_header*)image;
+  header->nr_chunks = htole32(nr_chunks);
+  header->size = htole64(size);
+  free(buffer);
+  free(offsets);
+  *image_size = size;
+  return image;
+}
+
+static void usage(const char* name) {
+  fprintf(stderr,
+          "Usage: %s [-c lz4|zstd] [-s chunk_size] input.tar output.img\n",
+          name);
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  const char* compressor = NULL;
+  uint32_t chunk_size = DEFAULT_CHUNK_SIZE;
+  int opt;
+  while ((opt = getopt(argc, argv, "c:s:")) != -1) {
+    switch (opt) {
+      case 'c':
+        compressor = optarg;
+        if (strcmp(compressor, "lz4") && strcmp(compressor, "zstd")) {
+          fprintf(stderr, "unknown compressor: %s\n", compressor);
+          return 1;
+        }
+        if (!have_compressor(compressor)) {
+          fprintf(stderr, "mkimage was built without %s\n", compressor);
+          return 1;
+        }
+        break;
+      case 's':
+        chunk_size = strtoul(optarg, NULL, 0);
+        if (!chunk_size || chunk_size % VIRT_FS_IMAGE_ALIGN ||
+            chunk_size > VIRT_FS_IMAGE_MAX_CHUNK) {
+          fprintf(stderr, "chunk size must be a multiple of %d up to %d\n",
+                  VIRT_FS_IMAGE_ALIGN, VIRT_FS_IMAGE_MAX_CHUNK);
+          return 1;
+        }
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (argc - optind != 2) {
+    usage(argv[0]);
+  }
+
+  size_t tar_size;
+  char* tar = read_file(argv[optind], &tar_size);
+  struct node* root = new_node("", 0, 1);
+  read_tar(root, tar, tar_size);
+
+  // Number the entries breadth first, so each directory's children end up
+  // next to each other.
+  int nr_entries = count_nodes(root);
+  struct node** entries = xrealloc(NULL, nr_entries * sizeof(struct node*));
+  int next = 1;
+  entries[0] = root;
+  for (int i = 0; i < nr_entries; i++) {
+    struct node* node = entries[i];
+    node->index = i;
+    qsort(node->children, node->nr_children, sizeof(struct node*),
+          compare_nodes);
+    for (int j = 0; j < node->nr_children; j++) {
+      entries[next++] = node->children[j];
+    }
+  }
+
+  uint64_t entries_offset = sizeof(struct virt_fs_image_header);
+  uint64_t names_offset =
+      entries_offset + nr_entries * sizeof(struct virt_fs_image_entry);
+  uint64_t names_size = 0;
+  for (int i = 0; i < nr_entries; i++) {
+    names_size += entries[i]->name_len;
+  }
+  uint64_t index_size =
+      align_up(names_offset + names_size, VIRT_FS_IMAGE_ALIGN);
+
+  // Compressed data goes in a buffer of its own, with offsets from its start.
+  uint64_t data_start = compressor ? 0 : index_size;
+  uint64_t data_end = data_start;
+  for (int i = 0; i < nr_entries; i++) {
+    if (!entries[i]->is_dir) {
+      entries[i]->data_offset = data_end;
+      data_end = align_up(data_end + entries[i]->size, VIRT_FS_IMAGE_ALIGN);
+    }
+  }
+  uint64_t image_size = compressor ? index_size : data_end;
+  char* data = compressor ? xrealloc(NULL, data_end) : NULL;
+
+  char* image = xrealloc(NULL, image_size);
+  memset(image, 0, image_size);
+  if (data) {
+    memset(data, 0, data_end);
+  } else {
+    data = image;
+  }
+  struct virt_fs_image_header* header = (struct virt_fs_image_header*)image;
+  memcpy(header->magic, VIRT_FS_IMAGE_MAGIC, sizeof(header->magic));
+  header->version = htole32(VIRT_FS_IMAGE_VERSION);
+  header->nr_entries = htole32(nr_entries);
+  header->entries_offset = htole64(entries_offset);
+  header->names_offset = htole64(names_offset);
+  header->names_size = htole64(names_size);
+  header->size = htole64(image_size);
+  if (compressor) {
+    strcpy(header->compressor, compressor);
+    header->chunk_size = htole32(chunk_size);
+    header->chunks_offset = htole64(index_size);
+    header->data_size = htole64(data_end);
+  }
+
+  struct virt_fs_image_entry* out_entries =
+      (struct virt_fs_image_entry*)(image + entries_offset);
+  uint64_t name_offset = 0;
+  for (int i = 0; i < nr_entries; i++) {
+    struct node* node = entries[i];
+    struct virt_fs_image_entry* entry = &out_entries[i];
+    memcpy(image + names_offset + name_offset, node->name, node->name_len);
+    entry->name_offset = htole32(name_offset);
+    entry->name_len = htole32(node->name_len);
+    name_offset += node->name_len;
+    if (node->is_dir) {
+      entry->flags = htole32(VIRT_FS_IMAGE_DIR);
+      entry->nr_children = htole32(node->nr_children);
+      if (node->nr_children) {
+        entry->first_child = htole32(node->children[0]->index);
+      }
+    } else {
+      memcpy(data + node->data_offset, node->data, node->size);
+      entry->data_offset = htole64(node->data_offset);
+      entry->size = htole64(node->size);
+    }
+  }
+
+  if (compressor) {
+    image = compress_data(image, &image_size, data, data_end, compressor,
+                          chunk_size);
+  }
+
+  const char* output = argv[optind + 1];
+  FILE* f = fopen(output, "wb");
+  if (!f) {
+    perror(output);
+    return 1;
+  }
+  if (fwrite(image, 1, image_size, f) != image_size || fclose(f)) {
+    perror(output);
+    return 1;
+  }
+  return 0;
+}
@@ -3,6 +3,7 @@
 
 #include <linux/fs.h>
 #include <linux/list.h>
+#include "virt_fs_image.h"
 
 // virt_fs_tar.c
 
@@ -13,15 +14,65 @@ struct virt_fs_node {
   // E.g. "file.jpg"
   const char* base_name;
 
-  // Is NULL if this is a directory.
+  // Length of base_name, not counting the trailing slash of directories.
+  int name_len;
+
+  bool is_dir;
+
+  // Where the file's data starts in the image. It can be reached through
+  // file_data too, unless the image is on a block device (then file_data
+  // is NULL).
+  loff_t file_offset;
   const char* file_data;
-  int file_size;
+  loff_t file_size;
 
   struct list_head parent_link;
   struct list_head children;
+
+  // Directories also hash their children by name.
+  struct hlist_node hash_link;
+  struct hlist_head* buckets;
+  unsigned int bucket_bits;
+  unsigned int nr_children;
+
+  // Holds the name if it doesn't point into the image.
+  char name_buf[];
 };
 
-struct virt_fs_node* virt_fs_read_tar(void);
+struct virt_fs_node* virt_fs_read_tar(const char* data, size_t size);
+struct virt_fs_node* virt_fs_read_tar_bdev(struct super_block* sb);
+struct virt_fs_node* virt_fs_find_child(struct virt_fs_node* dir,
+                                        const char* name,
+                                        int len);
 void virt_fs_free_tar(struct virt_fs_node* node);
 
+// virt_fs_packed.c
+
+bool virt_fs_packed_match(const char* data, size_t size);
+int virt_fs_packed_check(const char* data, size_t size);
+bool virt_fs_packed_compressed(const char* image);
+const struct virt_fs_image_entry* virt_fs_packed_entry(const char* image,
+                                                       u32 index);
+const char* virt_fs_packed_name(const char* image,
+                                const struct virt_fs_image_entry* entry);
+long virt_fs_packed_find_child(const char* image,
+                               const struct virt_fs_image_entry* dir,
+                               const char* name,
+                               int len);
+
+// virt_fs_comp.c
+
+struct virt_fs_comp;
+struct seq_file;
+
+int virt_fs_comp_init(struct virt_fs_comp** comp,
+                      const char* image,
+                      unsigned int cache_chunks);
+void virt_fs_comp_free(struct virt_fs_comp* comp);
+ssize_t virt_fs_comp_read(struct virt_fs_comp* comp,
+                          u64 pos,
+                          size_t len,
+                          struct iov_iter* to);
+void virt_fs_comp_show_stats(struct virt_fs_comp* comp, struct seq_file* m);
+
 #endif
\ No newline at end of file
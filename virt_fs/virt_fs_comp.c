@@ -0,0 +1,274 @@
+#include <linux/crypto.h>
+#include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/uio.h>
+#include "virt_fs.h"
+
+// Compressed images keep file data in chunks that were each compressed on
+// their own, so a read only decompresses the chunks it touches. The most
+// recently used chunks stay decompressed in a cache of bounded size.
+//
+// Cached chunks are reference counted, so a reader can copy out of one
+// (which may fault) without holding the cache lock while it's evicted.
+
+struct virt_fs_chunk {
+  struct kref ref;
+  struct list_head lru;
+  u32 index;
+  char data[];
+};
+
+// Compression contexts aren't safe to share, so each CPU gets its own.
+struct virt_fs_comp_stream {
+  struct mutex lock;
+  struct crypto_comp* tfm;
+};
+
+struct virt_fs_comp {
+  const char* image;
+  const __le64* offsets;
+  u32 chunk_size;
+  u32 nr_chunks;
+  u64 data_size;
+
+  struct virt_fs_comp_stream __percpu* streams;
+
+  // Protects everything below except the counters.
+  spinlock_t lock;
+  // The cached chunks, indexed by chunk number, most recently used first
+  // on the LRU list.
+  struct virt_fs_chunk** chunks;
+  struct list_head lru;
+  unsigned int nr_cached;
+  unsigned int max_cached;
+
+  atomic64_t hits;
+  atomic64_t misses;
+  atomic64_t evictions;
+};
+
+static void free_streams(struct virt_fs_comp* comp) {
+  int cpu;
+  for_each_possible_cpu(cpu) {
+    struct virt_fs_comp_stream* stream = per_cpu_ptr(comp->streams, cpu);
+    if (stream->tfm) {
+      crypto_free_comp(stream->tfm);
+    }
+  }
+  free_percpu(comp->streams);
+}
+
+int virt_fs_comp_init(struct virt_fs_comp** result,
+                      const char* image,
+                      unsigned int cache_chunks) {
+  const struct virt_fs_image_header* header =
+      (const struct virt_fs_image_header*)image;
+  struct virt_fs_comp* comp;
+  int cpu;
+
+  if (!crypto_has_comp(header->compressor, 0, 0)) {
+    printk(KERN_WARNING "virt_fs: unknown compressor %s\n",
+           header->compressor);
+    return -EINVAL;
+  }
+
+  comp = kzalloc(sizeof(struct virt_fs_comp), GFP_KERNEL);
+  if (!comp) {
+    return -ENOMEM;
+  }
+  comp->image = image;
+  comp->offsets =
+      (const __le64*)(image + le64_to_cpu(header->chunks_offset));
+  comp->chunk_size = le32_to_cpu(header->chunk_size);
+  comp->nr_chunks = le32_to_cpu(header->nr_chunks);
+  comp->data_size = le64_to_cpu(header->data_size);
+  spin_lock_init(&comp->lock);
+  INIT_LIST_HEAD(&comp->lru);
+  comp->max_cached = cache_chunks;
+
+  comp->chunks =
+      kvcalloc(comp->nr_chunks, sizeof(struct virt_fs_chunk*), GFP_KERNEL);
+  if (!comp->chunks) {
+    kfree(comp);
+    return -ENOMEM;
+  }
+
+  comp->streams = alloc_percpu(struct virt_fs_comp_stream);
+  if (!comp->streams) {
+    kvfree(comp->chunks);
+    kfree(comp);
+    return -ENOMEM;
+  }
+  for_each_possible_cpu(cpu) {
+    struct virt_fs_comp_stream* stream = per_cpu_ptr(comp->streams, cpu);
+    mutex_init(&stream->lock);
+    stream->tfm = crypto_alloc_comp(header->compressor, 0, 0);
+    if (IS_ERR(stream->tfm)) {
+      stream->tfm = NULL;
+      free_streams(comp);
+      kvfree(comp->chunks);
+      kfree(comp);
+      return -ENOMEM;
+    }
+  }
+
+  *result = comp;
+  return 0;
+}
+
+static void release_chunk(struct kref* ref) {
+  kvfree(container_of(ref, struct virt_fs_chunk, ref));
+}
+
+static void put_chunk(struct virt_fs_chunk* chunk) {
+  kref_put(&chunk->ref, release_chunk);
+}
+
+void virt_fs_comp_free(struct virt_fs_comp* comp) {
+  struct virt_fs_chunk* chunk;
+  struct virt_fs_chunk* tmp;
+  list_for_each_entry_safe(chunk, tmp, &comp->lru, lru) {
+    put_chunk(chunk);
+  }
+  free_streams(comp);
+  kvfree(comp->chunks);
+  kfree(comp);
+}
+
+static u32 chunk_len(struct virt_fs_comp* comp, u32 index) {
+  return min_t(u64, comp->chunk_size,
+               comp->data_size - (u64)index * comp->chunk_size);
+}
+
+static struct virt_fs_chunk* load_chunk(struct virt_fs_comp* comp, u32 index) {
+  u64 start = le64_to_cpu(comp->offsets[index]);
+  u64 end = le64_to_cpu(comp->offsets[index + 1]);
+  unsigned int len = chunk_len(comp, index);
+  struct virt_fs_chunk* chunk;
+
+  chunk = kvmalloc(struct_size(chunk, data, len), GFP_KERNEL);
+  if (!chunk) {
+    return ERR_PTR(-ENOMEM);
+  }
+  kref_init(&chunk->ref);
+  INIT_LIST_HEAD(&chunk->lru);
+  chunk->index = index;
+
+  if (end - start == len) {
+    memcpy(chunk->data, comp->image + start, len);
+  } else {
+    // A stream may be used by another CPU if this moves, but it's always
+    // the stream of the CPU it started on.
+    struct virt_fs_comp_stream* stream = raw_cpu_ptr(comp->streams);
+    unsigned int dlen = len;
+    int res;
+    mutex_lock(&stream->lock);
+    res = crypto_comp_decompress(stream->tfm, comp->image + start, end - start,
+                                 chunk->data, &dlen);
+    mutex_unlock(&stream->lock);
+    if (res || dlen != len) {
+      printk(KERN_ERR "virt_fs: failed to decompress chunk %u\n", index);
+      kvfree(chunk);
+      return ERR_PTR(-EIO);
+    }
+  }
+  return chunk;
+}
+
+// Get a reference to a decompressed chunk, from the cache if possible.
+static struct virt_fs_chunk* get_chunk(struct virt_fs_comp* comp, u32 index) {
+  struct virt_fs_chunk* chunk;
+  struct virt_fs_chunk* evicted = NULL;
+
+  spin_lock(&comp->lock);
+  chunk = comp->chunks[index];
+  if (chunk) {
+    list_move(&chunk->lru, &comp->lru);
+    kref_get(&chunk->ref);
+    spin_unlock(&comp->lock);
+    atomic64_inc(&comp->hits);
+    return chunk;
+  }
+  spin_unlock(&comp->lock);
+
+  atomic64_inc(&comp->misses);
+  chunk = load_chunk(comp, index);
+  if (IS_ERR(chunk)) {
+    return chunk;
+  }
+
+  spin_lock(&comp->lock);
+  if (comp->chunks[index]) {
+    // Another reader got here first, so use its copy.
+    struct virt_fs_chunk* cached = comp->chunks[index];
+    kref_get(&cached->ref);
+    spin_unlock(&comp->lock);
+    put_chunk(chunk);
+    return cached;
+  }
+  // One reference for the cache, and one for the caller.
+  kref_get(&chunk->ref);
+  comp->chunks[index] = chunk;
+  list_add(&chunk->lru, &comp->lru);
+  if (++comp->nr_cached > comp->max_cached) {
+    evicted = list_last_entry(&comp->lru, struct virt_fs_chunk, lru);
+    list_del(&evicted->lru);
+    comp->chunks[evicted->index] = NULL;
+    comp->nr_cached--;
+  }
+  spin_unlock(&comp->lock);
+
+  if (evicted) {
+    atomic64_inc(&comp->evictions);
+    put_chunk(evicted);
+  }
+  return chunk;
+}
+
+// Copy len bytes of uncompressed data, starting at pos, which the caller
+// has checked are within the data.
+ssize_t virt_fs_comp_read(struct virt_fs_comp* comp,
+                          u64 pos,
+                          size_t len,
+                          struct iov_iter* to) {
+  size_t done = 0;
+  while (done < len) {
+    u32 offset;
+    u32 index = div_u64_rem(pos, comp->chunk_size, &offset);
+    size_t size = min_t(size_t, len - done, comp->chunk_size - offset);
+    struct virt_fs_chunk* chunk = get_chunk(comp, index);
+    size_t copied;
+    if (IS_ERR(chunk)) {
+      return done ? done : PTR_ERR(chunk);
+    }
+    copied = copy_to_iter(chunk->data + offset, size, to);
+    put_chunk(chunk);
+    done += copied;
+    pos += copied;
+    if (copied < size) {
+      return done ? done : -EFAULT;
+    }
+  }
+  return done;
+}
+
+void virt_fs_comp_show_stats(struct virt_fs_comp* comp, struct seq_file* m) {
+  u64 hits = atomic64_read(&comp->hits);
+  u64 misses = atomic64_read(&comp->misses);
+  unsigned int nr_cached;
+  spin_lock(&comp->lock);
+  nr_cached = comp->nr_cached;
+  spin_unlock(&comp->lock);
+  seq_printf(m,
+             "chunk_cache: hits %llu misses %llu hit_rate %llu%% "
+             "evictions %lld cached %u/%u",
+             hits, misses,
+             hits + misses ? div64_u64(hits * 100, hits + misses) : 0,
+             atomic64_read(&comp->evictions), nr_cached, comp->max_cached);
+}
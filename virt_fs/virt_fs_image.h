@@ -0,0 +1,83 @@
+#ifndef __VIRT_FS_IMAGE_H__
+#define __VIRT_FS_IMAGE_H__
+
+// The packed image format, shared by the module and mkimage.
+//
+// A packed image is a tar that mkimage has indexed ahead of time, laid out
+// so the module can use it in place without parsing anything:
+//
+//   header | entries | names | file data
+//
+// Entry 0 is the root directory. Entries are ordered so that the children
+// of each directory are contiguous and sorted by name, which makes every
+// directory a range of entries and every lookup a binary search. The data
+// of each file starts on a VIRT_FS_IMAGE_ALIGN boundary, so its pages can
+// be mapped straight from the image.
+//
+// The file data can also be compressed, in which case the image looks like
+//
+//   header | entries | names | chunk table | chunks
+//
+// The data is laid out as it would be in an uncompressed image, but at
+// offsets from the start of the data instead of the image, and then split
+// into chunk_size pieces that are each compressed on their own. Chunk i is
+// stored between chunk table entries i and i + 1, so the table has
+// nr_chunks + 1 entries. Chunks that don't compress are stored as they
+// are, so a chunk that takes as much space as the data it holds is raw.
+//
+// All fields are little-endian.
+
+#include <linux/types.h>
+
+#define VIRT_FS_IMAGE_MAGIC "VFSIMAGE"
+#define VIRT_FS_IMAGE_VERSION 2
+#define VIRT_FS_IMAGE_ALIGN 4096
+#define VIRT_FS_IMAGE_MAX_CHUNK (1 << 20)
+
+struct virt_fs_image_header {
+  char magic[8];
+  __le32 version;
+  __le32 nr_entries;
+
+  // Offsets are from the start of the image.
+  __le64 entries_offset;
+  __le64 names_offset;
+  __le64 names_size;
+
+  // Size of the whole image.
+  __le64 size;
+
+  // The crypto API name of the compressor (e.g. "lz4" or "zstd"), or an
+  // empty string if the data isn't compressed. The rest of these are only
+  // used for compressed images.
+  char compressor[16];
+  __le32 chunk_size;
+  __le32 nr_chunks;
+  __le64 chunks_offset;
+
+  // Size of the data before it was compressed.
+  __le64 data_size;
+};
+
+#define VIRT_FS_IMAGE_DIR 1
+
+struct virt_fs_image_entry {
+  // The entry's base name, within the name table. Names aren't terminated.
+  __le32 name_offset;
+  __le32 name_len;
+
+  __le32 flags;
+
+  // For directories, the children are entries
+  // [first_child, first_child + nr_children).
+  __le32 first_child;
+  __le32 nr_children;
+  __le32 reserved;
+
+  // For files, where the data starts (from the start of the image, or of
+  // the uncompressed data in compressed images) and how long it is.
+  __le64 data_offset;
+  __le64 size;
+};
+
+#endif
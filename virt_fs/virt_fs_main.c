@@ -1,9 +1,21 @@
+#include <linux/buffer_head.h>
 #include <linux/fs.h>
 #include <linux/init.h>
+#include <linux/highmem.h>
 #include <linux/kernel.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/mpage.h>
+#include <linux/pagemap.h>
+#include <linux/parser.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/seq_file.h>
+#include <linux/sched/signal.h>
+#include <linux/slab.h>
+#include <linux/splice.h>
 #include <linux/statfs.h>
-#include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/vmalloc.h>
 #include "virt_fs.h"
 
 MODULE_LICENSE("GPL");
@@ -11,69 +23,130 @@ MODULE_AUTHOR("Alex Nichol");
 MODULE_DESCRIPTION("An in-memory virtual filesystem.");
 MODULE_VERSION("0.01");
 
-struct virt_fs_state {
-  struct vfsmount* mnt;
+// The packed example image built into the module (see virt_fs_data.S),
+// mounted when no image is given.
+extern const char virt_fs_data[];
+extern const char virt_fs_data_end[];
 
-  struct super_block* sb;
+// Per-mount state, kept in s_fs_info.
+struct virt_fs_info {
+  const char* data;
+  size_t size;
+
+  // The buffer an image was read into, or NULL for the built-in image.
+  void* buffer;
+
+  // Packed images are used in place. Anything else is a tar, indexed into
+  // a tree of nodes when it's mounted.
+  bool packed;
   struct virt_fs_node* root_node;
+
+  // Set if the packed image is compressed.
+  struct virt_fs_comp* comp;
 };
 
-static struct virt_fs_state state;
+// Decompressed chunks each mount caches by default.
+#define VIRT_FS_CACHE_CHUNKS 64
 
-static struct inode* inode_for_node(struct virt_fs_node* node);
+static struct inode* inode_for_node(struct super_block* sb,
+                                    struct virt_fs_node* node);
 static struct virt_fs_node* node_for_inode(struct inode* inode);
+static struct inode* inode_for_entry(struct super_block* sb,
+                                     const struct virt_fs_image_entry* entry);
+static const struct virt_fs_image_entry* entry_for_inode(struct inode* inode);
 
 // File operations
+//
+// Files in an image held in memory keep a pointer to their data in
+// i_private, so these work the same whichever kind of index found them.
 
 int virt_fs_open(struct inode* inode, struct file* file) {
-  printk(KERN_INFO "virt_fs: open\n");
-  file->private_data = node_for_inode(inode);
   return 0;
 }
 
-int virt_fs_iterate(struct file* file, struct dir_context* ctx) {
-  struct virt_fs_node* node = file->private_data;
-  printk(KERN_INFO "virt_fs: iterate(%lld)\n", ctx->pos);
-  dir_emit_dots(file, ctx);
-  if (ctx->pos == 2) {
-    struct virt_fs_node* child;
-    list_for_each_entry(child, &node->children, parent_link) {
-      struct inode* inode = inode_for_node(child);
-      int name_len = strlen(child->base_name);
-      if (child->base_name[name_len - 1] == '/') {
-        name_len--;
-      }
-      ctx->actor(ctx, child->base_name, name_len, ctx->pos, inode->i_ino,
-                 inode->i_mode);
-      ctx->pos++;
-    }
+// Get the page of the image holding a byte of file data.
+static struct page* data_page(const char* data) {
+  if (is_vmalloc_or_module_addr(data)) {
+    return vmalloc_to_page(data);
   }
-  return 0;
+  return virt_to_page(data);
 }
 
-ssize_t virt_fs_read(struct file* file,
-                     char __user* data,
-                     size_t size,
-                     loff_t* offset) {
-  size_t read_size = size;
-  struct virt_fs_node* node = file->private_data;
-  size_t remaining = (size_t)node->file_size - *offset;
-  if (*offset > (size_t)node->file_size) {
+ssize_t virt_fs_read_iter(struct kiocb* iocb, struct iov_iter* to) {
+  struct inode* inode = file_inode(iocb->ki_filp);
+  const char* data = inode->i_private;
+  loff_t file_size = i_size_read(inode);
+  size_t size;
+  size_t copied;
+  if (iocb->ki_pos >= file_size) {
     return 0;
   }
-  if (!node->file_data) {
-    return -EINVAL;
+  size = min_t(size_t, iov_iter_count(to), file_size - iocb->ki_pos);
+  copied = copy_to_iter(data + iocb->ki_pos, size, to);
+  if (size && !copied) {
+    return -EFAULT;
   }
-  if (remaining < read_size) {
-    read_size = remaining;
+  iocb->ki_pos += copied;
+  return copied;
+}
+
+// Splicing hands the pipe references to the image's own pages, so the
+// data is never copied on its way to a socket or another file.
+
+static const struct pipe_buf_operations virt_fs_pipe_buf_ops = {
+    .release = generic_pipe_buf_release,
+    .get = generic_pipe_buf_get,
+};
+
+static void virt_fs_spd_release(struct splice_pipe_desc* spd, unsigned int i) {
+  put_page(spd->pages[i]);
+}
+
+ssize_t virt_fs_splice_read(struct file* file,
+                            loff_t* pos,
+                            struct pipe_inode_info* pipe,
+                            size_t len,
+                            unsigned int flags) {
+  struct inode* inode = file_inode(file);
+  const char* file_data = inode->i_private;
+  loff_t file_size = i_size_read(inode);
+  struct page* pages[PIPE_DEF_BUFFERS];
+  struct partial_page partial[PIPE_DEF_BUFFERS];
+  struct splice_pipe_desc spd = {
+      .pages = pages,
+      .partial = partial,
+      .nr_pages_max = PIPE_DEF_BUFFERS,
+      .ops = &virt_fs_pipe_buf_ops,
+      .spd_release = virt_fs_spd_release,
+  };
+  loff_t offset = *pos;
+  ssize_t res;
+
+  if (offset >= file_size) {
+    return 0;
+  }
+  len = min_t(size_t, len, file_size - offset);
+  while (len && spd.nr_pages < spd.nr_pages_max) {
+    const char* data = file_data + offset;
+    unsigned int chunk =
+        min_t(size_t, len, PAGE_SIZE - offset_in_page(data));
+    pages[spd.nr_pages] = data_page(data);
+    get_page(pages[spd.nr_pages]);
+    partial[spd.nr_pages].offset = offset_in_page(data);
+    partial[spd.nr_pages].len = chunk;
+    spd.nr_pages++;
+    offset += chunk;
+    len -= chunk;
+  }
+
+  res = splice_to_pipe(pipe, &spd);
+  if (res > 0) {
+    *pos += res;
   }
-  copy_to_user(data, node->file_data + *offset, read_size);
-  (*offset) += read_size;
-  return read_size;
+  return res;
 }
 
 loff_t virt_fs_llseek(struct file* file, loff_t offset, int whence) {
-  struct virt_fs_node* node = file->private_data;
   switch (whence) {
     case SEEK_SET:
       break;
@@ -81,7 +154,7 @@ loff_t virt_fs_llseek(struct file* file, loff_t offset, int whence) {
       offset += file->f_pos;
       break;
     case SEEK_END:
-      offset += node->file_size;
+      offset += i_size_read(file_inode(file));
       break;
     default:
       return -EINVAL;
@@ -93,26 +166,224 @@ loff_t virt_fs_llseek(struct file* file, loff_t offset, int whence) {
   return offset;
 }
 
+// Memory mapping
+//
+// Whole pages of a file whose data starts on a page boundary are mapped
+// straight from the image, so they cost nothing however many processes
+// map them. Everything else (unaligned files, and the last page of every
+// file, which has to be zero past the end) goes through the page cache.
+
+static vm_fault_t virt_fs_fault(struct vm_fault* vmf) {
+  struct inode* inode = file_inode(vmf->vma->vm_file);
+  const char* data = inode->i_private;
+  loff_t pos = (loff_t)vmf->pgoff << PAGE_SHIFT;
+  if (!offset_in_page(data) && pos + PAGE_SIZE <= i_size_read(inode)) {
+    struct page* page = data_page(data + pos);
+    get_page(page);
+    vmf->page = page;
+    return 0;
+  }
+  return filemap_fault(vmf);
+}
+
+static const struct vm_operations_struct virt_fs_vm_ops = {
+    .fault = virt_fs_fault,
+    .map_pages = filemap_map_pages,
+};
+
+int virt_fs_mmap(struct file* file, struct vm_area_struct* vma) {
+  if ((vma->vm_flags & VM_SHARED) && (vma->vm_flags & VM_MAYWRITE)) {
+    // Private writable mappings are fine, since writes go to copies.
+    return -EACCES;
+  }
+  file_accessed(file);
+  vma->vm_ops = &virt_fs_vm_ops;
+  return 0;
+}
+
+static int virt_fs_readpage(struct file* file, struct page* page) {
+  struct inode* inode = page->mapping->host;
+  const char* data = inode->i_private;
+  loff_t file_size = i_size_read(inode);
+  loff_t pos = page_offset(page);
+  size_t len = 0;
+  char* dst;
+  if (pos < file_size) {
+    len = min_t(size_t, PAGE_SIZE, file_size - pos);
+  }
+  dst = kmap_atomic(page);
+  memcpy(dst, data + pos, len);
+  memset(dst + len, 0, PAGE_SIZE - len);
+  kunmap_atomic(dst);
+  flush_dcache_page(page);
+  SetPageUptodate(page);
+  unlock_page(page);
+  return 0;
+}
+
+static const struct address_space_operations virt_fs_aops = {
+    .readpage = virt_fs_readpage,
+};
+
 static struct file_operations virt_fs_fops = {
     .open = virt_fs_open,
-    .iterate = virt_fs_iterate,
-    .read = virt_fs_read,
+    .read_iter = virt_fs_read_iter,
+    .splice_read = virt_fs_splice_read,
     .llseek = virt_fs_llseek,
+    .mmap = virt_fs_mmap,
 };
 
-struct dentry* virt_fs_lookup(struct inode* inode,
-                              struct dentry* entry,
-                              unsigned int flags) {
+// Block devices
+//
+// When the image is on a block device, only its headers are read at mount
+// time. File data is read into the page cache on demand, with bios that
+// go straight from the device to the file's pages, so memory use follows
+// the working set rather than the size of the archive.
+
+static int virt_fs_get_block(struct inode* inode,
+                             sector_t block,
+                             struct buffer_head* bh,
+                             int create) {
   struct virt_fs_node* node = node_for_inode(inode);
+  sector_t nr_blocks = DIV_ROUND_UP(node->file_size, 512);
+  if (block >= nr_blocks) {
+    // Past the end of the file, so leave it unmapped to read as zeroes.
+    return 0;
+  }
+  // Files are contiguous, so map as much of the rest as was asked for.
+  map_bh(bh, inode->i_sb, (node->file_offset >> 9) + block);
+  bh->b_size = min_t(u64, bh->b_size, (u64)(nr_blocks - block) << 9);
+  return 0;
+}
+
+static int virt_fs_bdev_readpage(struct file* file, struct page* page) {
+  return mpage_readpage(page, virt_fs_get_block);
+}
+
+static void virt_fs_bdev_readahead(struct readahead_control* rac) {
+  mpage_readahead(rac, virt_fs_get_block);
+}
+
+static const struct address_space_operations virt_fs_bdev_aops = {
+    .readpage = virt_fs_bdev_readpage,
+    .readahead = virt_fs_bdev_readahead,
+};
+
+static struct file_operations virt_fs_bdev_fops = {
+    .open = virt_fs_open,
+    .read_iter = generic_file_read_iter,
+    .splice_read = generic_file_splice_read,
+    .llseek = virt_fs_llseek,
+    .mmap = generic_file_readonly_mmap,
+};
+
+// Compressed images
+//
+// Files of compressed images are read through the mount's cache of
+// decompressed chunks. Only mappings use the page cache.
+
+ssize_t virt_fs_comp_read_iter(struct kiocb* iocb, struct iov_iter* to) {
+  struct inode* inode = file_inode(iocb->ki_filp);
+  struct virt_fs_info* info = inode->i_sb->s_fs_info;
+  const struct virt_fs_image_entry* entry = entry_for_inode(inode);
+  loff_t file_size = i_size_read(inode);
+  ssize_t res;
+  if (iocb->ki_pos >= file_size) {
+    return 0;
+  }
+  res = virt_fs_comp_read(
+      info->comp, le64_to_cpu(entry->data_offset) + iocb->ki_pos,
+      min_t(size_t, iov_iter_count(to), file_size - iocb->ki_pos), to);
+  if (res > 0) {
+    iocb->ki_pos += res;
+  }
+  return res;
+}
+
+static int virt_fs_comp_readpage(struct file* file, struct page* page) {
+  struct inode* inode = page->mapping->host;
+  struct virt_fs_info* info = inode->i_sb->s_fs_info;
+  const struct virt_fs_image_entry* entry = entry_for_inode(inode);
+  loff_t file_size = i_size_read(inode);
+  loff_t pos = page_offset(page);
+  size_t len = 0;
+  struct kvec kvec;
+  struct iov_iter iter;
+  ssize_t res = 0;
+  char* dst;
+  if (pos < file_size) {
+    len = min_t(size_t, PAGE_SIZE, file_size - pos);
+  }
+  dst = kmap(page);
+  kvec.iov_base = dst;
+  kvec.iov_len = len;
+  iov_iter_kvec(&iter, READ, &kvec, 1, len);
+  if (len) {
+    res = virt_fs_comp_read(info->comp, le64_to_cpu(entry->data_offset) + pos,
+                            len, &iter);
+  }
+  if (res == len) {
+    memset(dst + len, 0, PAGE_SIZE - len);
+    flush_dcache_page(page);
+    SetPageUptodate(page);
+  } else {
+    SetPageError(page);
+  }
+  kunmap(page);
+  unlock_page(page);
+  return res < 0 ? res : 0;
+}
+
+static const struct address_space_operations virt_fs_comp_aops = {
+    .readpage = virt_fs_comp_readpage,
+};
+
+static struct file_operations virt_fs_comp_fops = {
+    .open = virt_fs_open,
+    .read_iter = virt_fs_comp_read_iter,
+    .splice_read = generic_file_splice_read,
+    .llseek = virt_fs_llseek,
+    .mmap = generic_file_readonly_mmap,
+};
+
+// Directories of tar images
+
+int virt_fs_iterate(struct file* file, struct dir_context* ctx) {
+  struct virt_fs_node* node = node_for_inode(file_inode(file));
   struct virt_fs_node* child;
+  loff_t i = 2;
+  if (!dir_emit_dots(file, ctx)) {
+    return 0;
+  }
+  // Inode numbers are node addresses, so there's no need to look up the
+  // children's inodes.
   list_for_each_entry(child, &node->children, parent_link) {
-    if (!memcmp(child->base_name, entry->d_name.name, entry->d_name.len)) {
-      char final_char = child->base_name[entry->d_name.len];
-      if (final_char == '/' || final_char == 0) {
-        d_add(entry, inode_for_node(child));
-      }
+    if (i++ < ctx->pos) {
+      continue;
+    }
+    if (!dir_emit(ctx, child->base_name, child->name_len,
+                  (unsigned long)child, child->is_dir ? DT_DIR : DT_REG)) {
       break;
     }
+    ctx->pos++;
+  }
+  return 0;
+}
+
+static struct file_operations virt_fs_dir_fops = {
+    .open = virt_fs_open,
+    .iterate = virt_fs_iterate,
+    .llseek = virt_fs_llseek,
+};
+
+struct dentry* virt_fs_lookup(struct inode* inode,
+                              struct dentry* entry,
+                              unsigned int flags) {
+  struct virt_fs_node* node = node_for_inode(inode);
+  struct virt_fs_node* child = virt_fs_find_child(
+      node, (const char*)entry->d_name.name, entry->d_name.len);
+  if (child) {
+    d_add(entry, inode_for_node(inode->i_sb, child));
   }
   return dget(entry);
 }
@@ -121,21 +392,91 @@ static struct inode_operations virt_fs_iops = {
     .lookup = virt_fs_lookup,
 };
 
-// Inodes and dentries.
+// Directories of packed images
 
-static struct inode* inode_for_node(struct virt_fs_node* node) {
-  struct inode* inode = iget_locked(state.sb, (unsigned long)node);
-  if (inode->i_state & I_NEW) {
-    inode->i_mode = 0777;
-    if (!node->file_data) {
-      inode->i_mode |= S_IFDIR;
-      inode->i_opflags = IOP_LOOKUP;
-    } else {
-      inode->i_mode |= S_IFREG;
+int virt_fs_packed_iterate(struct file* file, struct dir_context* ctx) {
+  struct inode* inode = file_inode(file);
+  struct virt_fs_info* info = inode->i_sb->s_fs_info;
+  const struct virt_fs_image_entry* dir = entry_for_inode(inode);
+  u32 first = le32_to_cpu(dir->first_child);
+  u32 count = le32_to_cpu(dir->nr_children);
+  if (!dir_emit_dots(file, ctx)) {
+    return 0;
+  }
+  for (; ctx->pos - 2 < count; ctx->pos++) {
+    const struct virt_fs_image_entry* child =
+        virt_fs_packed_entry(info->data, first + ctx->pos - 2);
+    unsigned char type =
+        le32_to_cpu(child->flags) & VIRT_FS_IMAGE_DIR ? DT_DIR : DT_REG;
+    if (!dir_emit(ctx, virt_fs_packed_name(info->data, child),
+                  le32_to_cpu(child->name_len), (unsigned long)child, type)) {
+      break;
     }
-    inode->i_fop = &virt_fs_fops;
+  }
+  return 0;
+}
+
+static struct file_operations virt_fs_packed_dir_fops = {
+    .open = virt_fs_open,
+    .iterate = virt_fs_packed_iterate,
+    .llseek = virt_fs_llseek,
+};
+
+struct dentry* virt_fs_packed_lookup(struct inode* inode,
+                                     struct dentry* entry,
+                                     unsigned int flags) {
+  struct virt_fs_info* info = inode->i_sb->s_fs_info;
+  struct inode* child_inode = NULL;
+  long child = virt_fs_packed_find_child(
+      info->data, entry_for_inode(inode), (const char*)entry->d_name.name,
+      entry->d_name.len);
+  if (child >= 0) {
+    child_inode =
+        inode_for_entry(inode->i_sb, virt_fs_packed_entry(info->data, child));
+  }
+  return d_splice_alias(child_inode, entry);
+}
+
+static struct inode_operations virt_fs_packed_iops = {
+    .lookup = virt_fs_packed_lookup,
+};
+
+// Inodes and dentries.
+//
+// Inode numbers are the addresses of the nodes (for tar images) or entries
+// (for packed images) they were made from.
+
+static void init_inode(struct super_block* sb,
+                       struct inode* inode,
+                       bool is_dir,
+                       loff_t size,
+                       const char* data) {
+  inode->i_mode = 0777;
+  inode->i_flags = 0;
+  if (is_dir) {
+    inode->i_mode |= S_IFDIR;
+    inode->i_opflags = IOP_LOOKUP;
+    inode->i_fop = &virt_fs_dir_fops;
     inode->i_op = &virt_fs_iops;
-    inode->i_flags = 0;
+  } else if (sb->s_bdev) {
+    inode->i_mode |= S_IFREG;
+    i_size_write(inode, size);
+    inode->i_mapping->a_ops = &virt_fs_bdev_aops;
+    inode->i_fop = &virt_fs_bdev_fops;
+  } else {
+    inode->i_mode |= S_IFREG;
+    i_size_write(inode, size);
+    inode->i_private = (void*)data;
+    inode->i_mapping->a_ops = &virt_fs_aops;
+    inode->i_fop = &virt_fs_fops;
+  }
+}
+
+static struct inode* inode_for_node(struct super_block* sb,
+                                    struct virt_fs_node* node) {
+  struct inode* inode = iget_locked(sb, (unsigned long)node);
+  if (inode->i_state & I_NEW) {
+    init_inode(sb, inode, node->is_dir, node->file_size, node->file_data);
     unlock_new_inode(inode);
   }
   return inode;
@@ -145,6 +486,32 @@ static struct virt_fs_node* node_for_inode(struct inode* inode) {
   return (struct virt_fs_node*)inode->i_ino;
 }
 
+static struct inode* inode_for_entry(struct super_block* sb,
+                                     const struct virt_fs_image_entry* entry) {
+  struct virt_fs_info* info = sb->s_fs_info;
+  struct inode* inode = iget_locked(sb, (unsigned long)entry);
+  if (inode->i_state & I_NEW) {
+    if (le32_to_cpu(entry->flags) & VIRT_FS_IMAGE_DIR) {
+      init_inode(sb, inode, true, 0, NULL);
+      inode->i_fop = &virt_fs_packed_dir_fops;
+      inode->i_op = &virt_fs_packed_iops;
+    } else if (info->comp) {
+      init_inode(sb, inode, false, le64_to_cpu(entry->size), NULL);
+      inode->i_mapping->a_ops = &virt_fs_comp_aops;
+      inode->i_fop = &virt_fs_comp_fops;
+    } else {
+      init_inode(sb, inode, false, le64_to_cpu(entry->size),
+                 info->data + le64_to_cpu(entry->data_offset));
+    }
+    unlock_new_inode(inode);
+  }
+  return inode;
+}
+
+static const struct virt_fs_image_entry* entry_for_inode(struct inode* inode) {
+  return (const struct virt_fs_image_entry*)inode->i_ino;
+}
+
 // Super block
 
 static struct file_system_type fs_type;
@@ -159,45 +526,245 @@ int virt_fs_statfs(struct dentry* entry, struct kstatfs* stats) {
   return 0;
 }
 
+static int virt_fs_show_stats(struct seq_file* m, struct dentry* root) {
+  struct virt_fs_info* info = root->d_sb->s_fs_info;
+  if (info->comp) {
+    virt_fs_comp_show_stats(info->comp, m);
+  }
+  return 0;
+}
+
 static struct super_operations super_ops = {
     .statfs = virt_fs_statfs,
+    .show_stats = virt_fs_show_stats,
 };
 
-static int virt_fs_fill_super(struct super_block* sb, void* data, int flags) {
-  struct inode* root_inode;
+// Images
+//
+// An image is read whole into vmalloc'd memory, so its files can be served
+// (and mapped) straight from the buffer just like the built-in image.
 
-  if (state.sb) {
-    return -EINVAL;
+// Largest single read from an image file.
+#define VIRT_FS_READ_BATCH (1 << 20)
+
+static int load_image(struct virt_fs_info* info, const char* path) {
+  struct file* file;
+  loff_t size;
+  loff_t pos = 0;
+  int res = 0;
+
+  file = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+  if (IS_ERR(file)) {
+    return PTR_ERR(file);
+  }
+  if (!S_ISREG(file_inode(file)->i_mode)) {
+    res = -EINVAL;
+    goto out;
   }
-  state.sb = sb;
+  size = i_size_read(file_inode(file));
+  info->buffer = vmalloc(max_t(loff_t, size, 1));
+  if (!info->buffer) {
+    res = -ENOMEM;
+    goto out;
+  }
+  while (pos < size) {
+    size_t want = min_t(loff_t, VIRT_FS_READ_BATCH, size - pos);
+    ssize_t got = kernel_read(file, info->buffer + pos, want, &pos);
+    if (got < 0) {
+      res = got;
+      goto out;
+    }
+    if (!got) {
+      // The file shrank while we read it.
+      size = pos;
+      break;
+    }
+    if (fatal_signal_pending(current)) {
+      res = -EINTR;
+      goto out;
+    }
+    cond_resched();
+  }
+  info->data = info->buffer;
+  info->size = size;
 
-  sb->s_blocksize_bits = 9;
-  sb->s_blocksize = 512;
-  sb->s_maxbytes = ((u64)1) << 32;
-  sb->s_type = &fs_type;
+out:
+  fput(file);
+  return res;
+}
+
+enum { Opt_image, Opt_cache_chunks, Opt_err };
+
+static const match_table_t tokens = {
+    {Opt_image, "image=%s"},
+    {Opt_cache_chunks, "cache_chunks=%u"},
+    {Opt_err, NULL},
+};
+
+static int parse_options(char* options,
+                         char** image,
+                         unsigned int* cache_chunks) {
+  char* p;
+  while ((p = strsep(&options, ",")) != NULL) {
+    substring_t args[MAX_OPT_ARGS];
+    if (!*p) {
+      continue;
+    }
+    switch (match_token(p, tokens, args)) {
+      case Opt_image:
+        kfree(*image);
+        *image = match_strdup(&args[0]);
+        if (!*image) {
+          return -ENOMEM;
+        }
+        break;
+      case Opt_cache_chunks:
+        if (match_uint(&args[0], cache_chunks) || !*cache_chunks) {
+          printk(KERN_ERR "virt_fs: invalid cache_chunks\n");
+          return -EINVAL;
+        }
+        break;
+      default:
+        printk(KERN_ERR "virt_fs: unknown option: %s\n", p);
+        return -EINVAL;
+    }
+  }
+  return 0;
+}
+
+static void free_info(struct virt_fs_info* info) {
+  if (info->comp) {
+    virt_fs_comp_free(info->comp);
+  }
+  if (info->root_node) {
+    virt_fs_free_tar(info->root_node);
+  }
+  vfree(info->buffer);
+  kfree(info);
+}
+
+static int fill_root(struct super_block* sb, struct virt_fs_info* info) {
+  struct inode* root_inode;
+
+  sb->s_maxbytes = MAX_LFS_FILESIZE;
   sb->s_op = &super_ops;
 
-  root_inode = inode_for_node(state.root_node);
-  printk(KERN_INFO "root_inode mode %d\n", root_inode->i_mode);
+  if (info->packed) {
+    root_inode = inode_for_entry(sb, virt_fs_packed_entry(info->data, 0));
+  } else {
+    root_inode = inode_for_node(sb, info->root_node);
+  }
 
   sb->s_root = d_make_root(root_inode);
-  if (IS_ERR(sb->s_root)) {
-    return PTR_ERR(sb->s_root);
+  if (!sb->s_root) {
+    return -ENOMEM;
   }
 
   return 0;
 }
 
+static int virt_fs_fill_super(struct super_block* sb, void* data, int flags) {
+  struct virt_fs_info* info;
+  char* image = NULL;
+  unsigned int cache_chunks = VIRT_FS_CACHE_CHUNKS;
+  int res;
+
+  info = kzalloc(sizeof(struct virt_fs_info), GFP_KERNEL);
+  if (!info) {
+    return -ENOMEM;
+  }
+  // From here on, kill_sb cleans up after any failure.
+  sb->s_fs_info = info;
+
+  res = parse_options(data, &image, &cache_chunks);
+  if (!res && image) {
+    res = load_image(info, image);
+  }
+  kfree(image);
+  if (res) {
+    return res;
+  }
+  if (!info->data) {
+    // Checked once when the module was loaded.
+    info->data = virt_fs_data;
+    info->size = virt_fs_data_end - virt_fs_data;
+    info->packed = true;
+  } else if (virt_fs_packed_match(info->data, info->size)) {
+    res = virt_fs_packed_check(info->data, info->size);
+    if (res) {
+      return res;
+    }
+    info->packed = true;
+  } else {
+    info->root_node = virt_fs_read_tar(info->data, info->size);
+    if (!info->root_node) {
+      return -EINVAL;
+    }
+  }
+  if (info->packed && virt_fs_packed_compressed(info->data)) {
+    res = virt_fs_comp_init(&info->comp, info->data, cache_chunks);
+    if (res) {
+      return res;
+    }
+  }
+
+  sb->s_blocksize_bits = 9;
+  sb->s_blocksize = 512;
+  return fill_root(sb, info);
+}
+
+static int virt_fs_blk_fill_super(struct super_block* sb,
+                                  void* data,
+                                  int flags) {
+  struct virt_fs_info* info;
+  char* image = NULL;
+  unsigned int cache_chunks = VIRT_FS_CACHE_CHUNKS;
+  int res;
+
+  info = kzalloc(sizeof(struct virt_fs_info), GFP_KERNEL);
+  if (!info) {
+    return -ENOMEM;
+  }
+  sb->s_fs_info = info;
+
+  res = parse_options(data, &image, &cache_chunks);
+  if (!res && image) {
+    printk(KERN_ERR "virt_fs: image= can't be used with a block device\n");
+    res = -EINVAL;
+  }
+  kfree(image);
+  if (res) {
+    return res;
+  }
+
+  // File data is only 512-byte aligned in a tar, so blocks must be too.
+  if (!sb_set_blocksize(sb, 512)) {
+    printk(KERN_ERR "virt_fs: device doesn't support 512-byte blocks\n");
+    return -EINVAL;
+  }
+  info->root_node = virt_fs_read_tar_bdev(sb);
+  if (!info->root_node) {
+    return -EINVAL;
+  }
+  return fill_root(sb, info);
+}
+
 // File system type
 
 static struct dentry* virt_fs_mount(struct file_system_type* type,
                                     int flags,
                                     const char* dev_name,
                                     void* data) {
-  return mount_single(type, flags, NULL, virt_fs_fill_super);
+  return mount_nodev(type, flags, data, virt_fs_fill_super);
 }
 
-static void virt_fs_kill_sb(struct super_block* sb) {}
+static void virt_fs_kill_sb(struct super_block* sb) {
+  struct virt_fs_info* info = sb->s_fs_info;
+  kill_anon_super(sb);
+  if (info) {
+    free_info(info);
+  }
+}
 
 static struct file_system_type fs_type = {
     .name = "virt_fs",
@@ -206,25 +773,54 @@ static struct file_system_type fs_type = {
     .owner = THIS_MODULE,
 };
 
+static struct dentry* virt_fs_blk_mount(struct file_system_type* type,
+                                        int flags,
+                                        const char* dev_name,
+                                        void* data) {
+  // Nothing is ever written, so the device only has to be readable.
+  return mount_bdev(type, flags | SB_RDONLY, dev_name, data,
+                    virt_fs_blk_fill_super);
+}
+
+static void virt_fs_blk_kill_sb(struct super_block* sb) {
+  struct virt_fs_info* info = sb->s_fs_info;
+  kill_block_super(sb);
+  if (info) {
+    free_info(info);
+  }
+}
+
+static struct file_system_type blk_fs_type = {
+    .name = "virt_fs_blk",
+    .mount = virt_fs_blk_mount,
+    .kill_sb = virt_fs_blk_kill_sb,
+    .owner = THIS_MODULE,
+    .fs_flags = FS_REQUIRES_DEV,
+};
+
 // Module lifecycle
 
 static int __init virt_fs_init(void) {
-  int res;
-  state.root_node = virt_fs_read_tar();
-  if (!state.root_node) {
-    return -EINVAL;
+  int res = virt_fs_packed_check(virt_fs_data, virt_fs_data_end - virt_fs_data);
+  if (res) {
+    printk(KERN_ERR "virt_fs: built-in image is invalid\n");
+    return res;
   }
   res = register_filesystem(&fs_type);
   if (res) {
-    virt_fs_free_tar(state.root_node);
+    return res;
+  }
+  res = register_filesystem(&blk_fs_type);
+  if (res) {
+    unregister_filesystem(&fs_type);
     return res;
   }
   return 0;
 }
 
 static void __exit virt_fs_exit(void) {
+  unregister_filesystem(&blk_fs_type);
   unregister_filesystem(&fs_type);
-  virt_fs_free_tar(state.root_node);
 }
 
 module_init(virt_fs_init);
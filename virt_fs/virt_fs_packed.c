@@ -0,0 +1,159 @@
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include "virt_fs.h"
+
+// Packed images are used in place: nothing is allocated for their entries,
+// and looking up a name is a binary search over its directory's range of
+// entries.
+
+static const struct virt_fs_image_header* image_header(const char* image) {
+  return (const struct virt_fs_image_header*)image;
+}
+
+bool virt_fs_packed_match(const char* data, size_t size) {
+  return size >= sizeof(struct virt_fs_image_header) &&
+         !memcmp(data, VIRT_FS_IMAGE_MAGIC, sizeof(image_header(data)->magic));
+}
+
+bool virt_fs_packed_compressed(const char* image) {
+  return image_header(image)->compressor[0];
+}
+
+static int check_chunks(const char* data, u64 size) {
+  const struct virt_fs_image_header* header = image_header(data);
+  const __le64* offsets;
+  u64 chunks_offset = le64_to_cpu(header->chunks_offset);
+  u64 data_size = le64_to_cpu(header->data_size);
+  u32 chunk_size = le32_to_cpu(header->chunk_size);
+  u32 nr_chunks = le32_to_cpu(header->nr_chunks);
+  u32 i;
+
+  if (!memchr(header->compressor, 0, sizeof(header->compressor)) ||
+      !chunk_size || chunk_size > VIRT_FS_IMAGE_MAX_CHUNK ||
+      !IS_ALIGNED(chunk_size, VIRT_FS_IMAGE_ALIGN) ||
+      nr_chunks != DIV_ROUND_UP_ULL(data_size, chunk_size) ||
+      chunks_offset > size || !IS_ALIGNED(chunks_offset, sizeof(*offsets)) ||
+      (u64)nr_chunks + 1 > (size - chunks_offset) / sizeof(*offsets)) {
+    return -EINVAL;
+  }
+
+  offsets = (const __le64*)(data + chunks_offset);
+  for (i = 0; i < nr_chunks; i++) {
+    u64 start = le64_to_cpu(offsets[i]);
+    u64 end = le64_to_cpu(offsets[i + 1]);
+    u64 len = min_t(u64, chunk_size, data_size - (u64)i * chunk_size);
+    if (start > end || end > size || end - start > len) {
+      return -EINVAL;
+    }
+  }
+  return 0;
+}
+
+// Check that every offset in an image stays inside it, so that nothing
+// else has to. This is a single pass over the entries (and chunks).
+int virt_fs_packed_check(const char* data, size_t size) {
+  const struct virt_fs_image_header* header = image_header(data);
+  const struct virt_fs_image_entry* entries;
+  u64 entries_offset;
+  u64 names_size;
+  // Where file data has to end.
+  u64 data_end;
+  u32 nr_entries;
+  u32 i;
+
+  if (!virt_fs_packed_match(data, size) ||
+      le32_to_cpu(header->version) != VIRT_FS_IMAGE_VERSION ||
+      le64_to_cpu(header->size) > size) {
+    return -EINVAL;
+  }
+  size = le64_to_cpu(header->size);
+  nr_entries = le32_to_cpu(header->nr_entries);
+  entries_offset = le64_to_cpu(header->entries_offset);
+  names_size = le64_to_cpu(header->names_size);
+  if (!nr_entries || entries_offset > size ||
+      !IS_ALIGNED(entries_offset, __alignof__(struct virt_fs_image_entry)) ||
+      nr_entries > (size - entries_offset) / sizeof(*entries) ||
+      le64_to_cpu(header->names_offset) > size ||
+      names_size > size - le64_to_cpu(header->names_offset)) {
+    return -EINVAL;
+  }
+  data_end = size;
+  if (virt_fs_packed_compressed(data)) {
+    int res = check_chunks(data, size);
+    if (res) {
+      return res;
+    }
+    data_end = le64_to_cpu(header->data_size);
+  }
+
+  entries = (const struct virt_fs_image_entry*)(data + entries_offset);
+  if (!(le32_to_cpu(entries[0].flags) & VIRT_FS_IMAGE_DIR)) {
+    return -EINVAL;
+  }
+  for (i = 0; i < nr_entries; i++) {
+    const struct virt_fs_image_entry* entry = &entries[i];
+    if ((u64)le32_to_cpu(entry->name_offset) + le32_to_cpu(entry->name_len) >
+        names_size) {
+      return -EINVAL;
+    }
+    if (le32_to_cpu(entry->flags) & VIRT_FS_IMAGE_DIR) {
+      u32 first = le32_to_cpu(entry->first_child);
+      u32 count = le32_to_cpu(entry->nr_children);
+      // Children always come after their parent, so there are no cycles.
+      if (count && (first <= i || count > nr_entries - first)) {
+        return -EINVAL;
+      }
+    } else {
+      u64 offset = le64_to_cpu(entry->data_offset);
+      if (offset > data_end || le64_to_cpu(entry->size) > data_end - offset) {
+        return -EINVAL;
+      }
+    }
+  }
+  return 0;
+}
+
+const struct virt_fs_image_entry* virt_fs_packed_entry(const char* image,
+                                                       u32 index) {
+  const struct virt_fs_image_header* header = image_header(image);
+  const struct virt_fs_image_entry* entries =
+      (const void*)(image + le64_to_cpu(header->entries_offset));
+  return &entries[index];
+}
+
+const char* virt_fs_packed_name(const char* image,
+                                const struct virt_fs_image_entry* entry) {
+  return image + le64_to_cpu(image_header(image)->names_offset) +
+         le32_to_cpu(entry->name_offset);
+}
+
+// Order names the same way mkimage sorts them.
+static int compare_name(const char* a, int a_len, const char* b, int b_len) {
+  int res = memcmp(a, b, min(a_len, b_len));
+  if (res) {
+    return res;
+  }
+  return a_len - b_len;
+}
+
+long virt_fs_packed_find_child(const char* image,
+                               const struct virt_fs_image_entry* dir,
+                               const char* name,
+                               int len) {
+  u32 low = le32_to_cpu(dir->first_child);
+  u32 high = low + le32_to_cpu(dir->nr_children);
+  while (low < high) {
+    u32 mid = low + (high - low) / 2;
+    const struct virt_fs_image_entry* entry = virt_fs_packed_entry(image, mid);
+    int res = compare_name(name, len, virt_fs_packed_name(image, entry),
+                           le32_to_cpu(entry->name_len));
+    if (!res) {
+      return mid;
+    } else if (res < 0) {
+      high = mid;
+    } else {
+      low = mid + 1;
+    }
+  }
+  return -ENOENT;
+}
@@ -1,14 +1,17 @@
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
 #include <linux/gfp.h>
+#include <linux/hash.h>
+#include <linux/mm.h>
 #include <linux/slab.h>
+#include <linux/stringhash.h>
 #include "virt_fs.h"
 
-extern const char* virt_fs_data;
-extern const int virt_fs_data_size;
-
 static const char* get_basename(const char* name) {
   int last_slash = -1;
+  int len = strlen(name);
   int i;
-  for (i = 0; i < strlen(name) - 1; ++i) {
+  for (i = 0; i + 1 < len; ++i) {
     if (name[i] == '/') {
       last_slash = i;
     }
@@ -16,96 +19,264 @@ static const char* get_basename(const char* name) {
   return name + last_slash + 1;
 }
 
-static const char* get_dirname(const char* name) {
-  static char res[256];
-  int last_slash = -1;
-  int i;
-  for (i = 0; i < strlen(name) - 1 && i + 1 < sizeof(res); ++i) {
-    if (name[i] == '/') {
-      last_slash = i;
-    }
-    res[i] = name[i];
-  }
-  res[last_slash + 1] = 0;
-  return res;
+// Directories hash their children by name into a table that doubles in
+// size whenever it has more children than buckets, so lookups stay O(1)
+// even in directories with tens of thousands of entries.
+
+static struct hlist_head* child_bucket(struct virt_fs_node* dir,
+                                       const char* name,
+                                       int len) {
+  u32 hash = full_name_hash(NULL, name, len);
+  return &dir->buckets[hash_32(hash, dir->bucket_bits)];
 }
 
-static struct virt_fs_node* find_node(struct virt_fs_node* parent,
-                                      const char* name) {
-  if (!strcmp(parent->full_name, name)) {
-    return parent;
+struct virt_fs_node* virt_fs_find_child(struct virt_fs_node* dir,
+                                        const char* name,
+                                        int len) {
+  struct virt_fs_node* child;
+  if (!dir->buckets) {
+    return NULL;
   }
-  if (!parent->file_data) {
-    struct virt_fs_node* node;
-    list_for_each_entry(node, &parent->children, parent_link) {
-      struct virt_fs_node* res = find_node(node, name);
-      if (res) {
-        return res;
-      }
+  hlist_for_each_entry(child, child_bucket(dir, name, len), hash_link) {
+    if (child->name_len == len && !memcmp(child->base_name, name, len)) {
+      return child;
     }
   }
   return NULL;
 }
 
-static void insert_child(struct virt_fs_node* parent,
-                         struct virt_fs_node* child) {
+static int grow_buckets(struct virt_fs_node* dir) {
+  unsigned int bits = dir->buckets ? dir->bucket_bits + 1 : 2;
+  struct hlist_head* buckets;
+  struct virt_fs_node* child;
+
+  buckets = kvcalloc(1U << bits, sizeof(struct hlist_head), GFP_KERNEL);
+  if (!buckets) {
+    return -ENOMEM;
+  }
+  kvfree(dir->buckets);
+  dir->buckets = buckets;
+  dir->bucket_bits = bits;
+  list_for_each_entry(child, &dir->children, parent_link) {
+    hlist_add_head(&child->hash_link,
+                   child_bucket(dir, child->base_name, child->name_len));
+  }
+  return 0;
+}
+
+static int insert_child(struct virt_fs_node* parent,
+                        struct virt_fs_node* child) {
+  if (!parent->buckets || parent->nr_children >= 1U << parent->bucket_bits) {
+    int res = grow_buckets(parent);
+    if (res) {
+      return res;
+    }
+  }
   list_add(&child->parent_link, &parent->children);
+  hlist_add_head(&child->hash_link,
+                 child_bucket(parent, child->base_name, child->name_len));
+  parent->nr_children++;
+  return 0;
+}
+
+// Find the directory that should contain a path, by looking up each of
+// its leading components in turn.
+static struct virt_fs_node* find_parent(struct virt_fs_node* root,
+                                        const char* name) {
+  const char* base = get_basename(name);
+  struct virt_fs_node* node = root;
+  while (name < base) {
+    const char* slash = strchr(name, '/');
+    node = virt_fs_find_child(node, name, slash - name);
+    if (!node || !node->is_dir) {
+      return NULL;
+    }
+    name = slash + 1;
+  }
+  return node;
+}
+
+static struct virt_fs_node* new_node(const char* full_name, bool copy_name) {
+  size_t name_size = copy_name ? strlen(full_name) + 1 : 0;
+  struct virt_fs_node* node =
+      kzalloc(sizeof(struct virt_fs_node) + name_size, GFP_KERNEL);
+  if (!node) {
+    return NULL;
+  }
+  if (copy_name) {
+    memcpy(node->name_buf, full_name, name_size);
+    full_name = node->name_buf;
+  }
+  node->full_name = full_name;
+  node->base_name = get_basename(full_name);
+  node->name_len = strlen(node->base_name);
+  if (node->name_len && node->base_name[node->name_len - 1] == '/') {
+    node->name_len--;
+  }
+  INIT_LIST_HEAD(&node->children);
+  return node;
+}
+
+// The parser reads headers either straight out of an image in memory, or
+// from a block device through the buffer cache.
+
+// Number of blocks to read ahead of each header read from a block device,
+// since the next few headers are usually close by.
+#define TAR_HEADER_READAHEAD 64
+
+struct tar_source {
+  loff_t size;
+
+  const char* data;
+
+  struct super_block* sb;
+  struct buffer_head* bh;
+  sector_t readahead_end;
+};
+
+static const char* read_header(struct tar_source* src, loff_t offset) {
+  sector_t block;
+  if (src->data) {
+    return src->data + offset;
+  }
+  block = offset >> src->sb->s_blocksize_bits;
+  if (block >= src->readahead_end) {
+    sector_t end = min_t(sector_t, block + TAR_HEADER_READAHEAD,
+                         src->size >> src->sb->s_blocksize_bits);
+    struct blk_plug plug;
+    blk_start_plug(&plug);
+    for (src->readahead_end = block + 1; src->readahead_end < end;
+         src->readahead_end++) {
+      sb_breadahead(src->sb, src->readahead_end);
+    }
+    blk_finish_plug(&plug);
+  }
+  brelse(src->bh);
+  src->bh = sb_bread(src->sb, block);
+  if (!src->bh) {
+    return NULL;
+  }
+  return src->bh->b_data + (offset & (src->sb->s_blocksize - 1));
 }
 
-struct virt_fs_node* virt_fs_read_tar() {
-  int offset;
-  struct virt_fs_node* root_node =
-      kmalloc(sizeof(struct virt_fs_node), GFP_KERNEL);
-  memset(root_node, 0, sizeof(*root_node));
-  INIT_LIST_HEAD(&root_node->children);
-  root_node->full_name = "";
-  root_node->base_name = "";
-
-  for (offset = 0; offset + 512 <= virt_fs_data_size; offset += 512) {
-    const char* full_name = virt_fs_data + offset;
-    struct virt_fs_node* new_node;
-    struct virt_fs_node* parent = find_node(root_node, get_dirname(full_name));
-    if (!strlen(full_name)) {
+// Parse a header's size field: octal digits, possibly padded with leading
+// spaces or NULs, and ended by a space or NUL (or the end of the field).
+// Returns -EINVAL if there are no digits.
+static int parse_size(const char* field, loff_t* size) {
+  int i = 0;
+  bool found = false;
+  *size = 0;
+  while (i < 12 && (field[i] == ' ' || !field[i])) {
+    i++;
+  }
+  for (; i < 12 && field[i] >= '0' && field[i] <= '7'; i++) {
+    *size = *size * 8 + (field[i] - '0');
+    found = true;
+  }
+  return found ? 0 : -EINVAL;
+}
+
+// Index a tar in a single pass over its headers. The image may come from
+// userspace, so every header is checked to stay inside it.
+static struct virt_fs_node* read_tar(struct tar_source* src) {
+  loff_t offset;
+  // Names have to be copied out of headers that won't stay in memory.
+  bool copy_names = !src->data;
+  struct virt_fs_node* root_node = new_node("", false);
+  // Tar files list a directory's entries together, so most entries have
+  // the same parent as the one before.
+  struct virt_fs_node* last_parent = root_node;
+  if (!root_node) {
+    return NULL;
+  }
+  root_node->is_dir = true;
+
+  for (offset = 0; offset + 512 <= src->size; offset += 512) {
+    const char* header = read_header(src, offset);
+    const char* full_name = header;
+    struct virt_fs_node* node;
+    struct virt_fs_node* parent = last_parent;
+    size_t prefix_len = strlen(parent->full_name);
+    if (!header) {
+      goto fail;
+    }
+    // Everything below can treat the name as a string once it's known to
+    // end inside its field.
+    if (!memchr(full_name, 0, 100)) {
+      // Names that fill the whole field aren't supported.
+      goto fail;
+    }
+    if (!full_name[0]) {
       continue;
     }
+    if (get_basename(full_name) != full_name + prefix_len ||
+        strncmp(full_name, parent->full_name, prefix_len)) {
+      parent = find_parent(root_node, full_name);
+    }
     if (!parent) {
-      virt_fs_free_tar(root_node);
-      return NULL;
+      goto fail;
     }
-    new_node =
-        (struct virt_fs_node*)kmalloc(sizeof(struct virt_fs_node), GFP_KERNEL);
-    memset(new_node, 0, sizeof(*new_node));
-    new_node->full_name = full_name;
-    new_node->base_name = get_basename(new_node->full_name);
-    if (full_name[strlen(full_name) - 1] != '/') {
-      char size_str[13];
-      long file_size;
-      memset(size_str, 0, 13);
-      memcpy(size_str, virt_fs_data + offset + 124, 12);
-      kstrtol(size_str, 8, &file_size);
-      new_node->file_size = (int)file_size;
-      new_node->file_data = virt_fs_data + offset + 512;
-      offset += new_node->file_size;
-      if (new_node->file_size % 512) {
-        offset += 512 - (new_node->file_size % 512);
-      }
+    last_parent = parent;
+    node = new_node(full_name, copy_names);
+    if (!node) {
+      goto fail;
+    }
+    if (full_name[strlen(full_name) - 1] == '/') {
+      node->is_dir = true;
     } else {
-      INIT_LIST_HEAD(&new_node->children);
+      loff_t file_size;
+      if (parse_size(header + 124, &file_size) ||
+          file_size > src->size - offset - 512) {
+        kfree(node);
+        goto fail;
+      }
+      node->file_size = file_size;
+      node->file_offset = offset + 512;
+      if (src->data) {
+        node->file_data = src->data + node->file_offset;
+      }
+      offset += round_up(node->file_size, 512);
+    }
+    if (insert_child(parent, node)) {
+      kfree(node);
+      goto fail;
     }
-    insert_child(parent, new_node);
   }
 
+  brelse(src->bh);
   return root_node;
+
+fail:
+  brelse(src->bh);
+  virt_fs_free_tar(root_node);
+  return NULL;
+}
+
+struct virt_fs_node* virt_fs_read_tar(const char* data, size_t size) {
+  struct tar_source src = {
+      .size = size,
+      .data = data,
+  };
+  return read_tar(&src);
+}
+
+struct virt_fs_node* virt_fs_read_tar_bdev(struct super_block* sb) {
+  struct tar_source src = {
+      .size = i_size_read(sb->s_bdev->bd_inode),
+      .sb = sb,
+  };
+  return read_tar(&src);
 }
 
 void virt_fs_free_tar(struct virt_fs_node* node) {
-  if (!node->file_data) {
+  if (node->is_dir) {
     struct list_head* list = node->children.next;
     while (list != &node->children) {
       struct list_head* tmp = list->next;
       virt_fs_free_tar(list_entry(list, struct virt_fs_node, parent_link));
       list = tmp;
     }
+    kvfree(node->buckets);
   }
   kfree(node);
 }